@@ -341,6 +341,60 @@ TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
     return qht_lookup(&tb_ctx.htable, tb_cmp, &desc, h);
 }
 
+/* Like tb_cmp, but without looking up the second page in the softmmu TLB */
+static bool tb_cmp_page1(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    return tb->pc == desc->pc &&
+           tb->page_addr[0] == desc->phys_page1 &&
+           tb->cs_base == desc->cs_base &&
+           tb->flags == desc->flags &&
+           tb->trace_vcpu_dstate == desc->trace_vcpu_dstate &&
+           (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == desc->cf_mask;
+}
+
+/*
+ * Return how many times the TB starting at @pc, translated for the same
+ * context as @tb, has been executed: TB_HOT_THRESHOLD if it already is a
+ * superblock, and 0 if there is no such TB. TBs outside the guest page of
+ * @tb->pc are not looked up and count as never executed.
+ *
+ * This is only a hint for superblock formation, to be used while
+ * translating @tb; it never faults.
+ */
+uint32_t tb_exec_count_hint(const TranslationBlock *tb, target_ulong pc)
+{
+    TranslationBlock *dest;
+    tb_page_addr_t phys_pc;
+    struct tb_desc desc;
+    uint32_t h;
+
+    if (tb->page_addr[0] == -1 ||
+        (pc & TARGET_PAGE_MASK) != (tb->pc & TARGET_PAGE_MASK)) {
+        return 0;
+    }
+    desc.env = NULL;
+    desc.cs_base = tb->cs_base;
+    desc.flags = tb->flags;
+    desc.cf_mask = tb_cflags(tb) & CF_HASH_MASK;
+    desc.trace_vcpu_dstate = tb->trace_vcpu_dstate;
+    desc.pc = pc;
+    desc.phys_page1 = tb->page_addr[0];
+    phys_pc = desc.phys_page1 | (pc & ~TARGET_PAGE_MASK);
+    h = tb_hash_func(phys_pc, pc, desc.flags, desc.cf_mask,
+                     desc.trace_vcpu_dstate);
+    dest = qht_lookup(&tb_ctx.htable, tb_cmp_page1, &desc, h);
+    if (dest == NULL) {
+        return 0;
+    }
+    if (tb_cflags(dest) & CF_SUPERBLOCK) {
+        return TB_HOT_THRESHOLD;
+    }
+    return MIN(atomic_read(&dest->exec_count), TB_HOT_THRESHOLD);
+}
+
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr)
 {
     if (TCG_TARGET_HAS_direct_jump) {
@@ -32,6 +32,8 @@
 #include "exec/log.h"
 #include "exec/helper-proto.h"
 #include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "exec/tb-hash.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -105,6 +107,211 @@ size_t tlb_flush_count(void)
     return count;
 }
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Dynamic TLB sizing
+ *
+ * Each MMU mode has its own TLB whose size is a power of two between
+ * 1 << CPU_TLB_DYN_MIN_BITS and 1 << CPU_TLB_DYN_MAX_BITS entries.  The
+ * number of valid entries is tracked between flushes, and the table is
+ * resized at flush time (when it is empty anyway) based on how full it
+ * got during the last window of TLB_WINDOW_NS nanoseconds.
+ *
+ * The tables are only reallocated by their owning vCPU, with tlb_lock
+ * held so that the cross-vCPU tlb_reset_dirty never walks a stale table.
+ */
+#define TLB_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
+                             size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+static void tlb_dyn_init(CPUArchState *env)
+{
+    int i;
+
+    qemu_spin_init(&env->tlb_lock);
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        CPUTLBDesc *desc = &env->tlb_d[i];
+        size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+
+        tlb_window_reset(desc, get_clock_realtime(), 0);
+        desc->n_used_entries = 0;
+        env->tlb_mask[i] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+        env->tlb_table[i] = g_new(CPUTLBEntry, n_entries);
+        env->iotlb[i] = g_new(CPUIOTLBEntry, n_entries);
+        memset(env->tlb_table[i], -1, sizeof(CPUTLBEntry) * n_entries);
+    }
+}
+
+/**
+ * tlb_mmu_resize_locked() - perhaps resize a TLB
+ * @env: CPU that owns the TLB
+ * @mmu_idx: MMU index of the TLB
+ *
+ * Called with tlb_lock held, on a flush of @mmu_idx's TLB.
+ *
+ * The table is doubled when more than 70% of its entries were in use
+ * at flush time: a high rate of use means the working set does not
+ * fit, and conflict misses would be costing us refills.
+ *
+ * The table is shrunk only once a whole window has gone by with the
+ * maximum use below 30%, so that one short burst of flushes (e.g. a
+ * guest context switching between small processes) does not throw
+ * away a table that the next phase needs.  The new size is the
+ * smallest power of two holding the window's maximum, doubled if that
+ * would put the rate of use above 70% again.
+ */
+static void tlb_mmu_resize_locked(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t rate;
+    size_t new_size = old_size;
+    int64_t now = get_clock_realtime();
+    int64_t window_len_ns = TLB_WINDOW_NS;
+    bool window_expired = now > desc->window_begin_ns + window_len_ns;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = pow2ceil(desc->window_max_entries);
+        size_t expected_rate = desc->window_max_entries * 100 / ceil;
+
+        if (expected_rate > 70) {
+            ceil *= 2;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, desc->n_used_entries);
+        }
+        return;
+    }
+
+    g_free(env->tlb_table[mmu_idx]);
+    g_free(env->iotlb[mmu_idx]);
+
+    tlb_window_reset(desc, now, 0);
+    /* desc->n_used_entries is cleared by the caller */
+    env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = g_try_new(CPUTLBEntry, new_size);
+    env->iotlb[mmu_idx] = g_try_new(CPUIOTLBEntry, new_size);
+    /*
+     * If the allocations fail, try smaller sizes.  We just freed some
+     * memory, so going back to half of new_size has a good chance of
+     * working.  Increased memory pressure elsewhere in the system might
+     * cause the allocations to fail though, so we progressively reduce
+     * the allocation size, aborting if we cannot even allocate the
+     * smallest TLB we support.
+     */
+    while (env->tlb_table[mmu_idx] == NULL || env->iotlb[mmu_idx] == NULL) {
+        if (new_size == (1 << CPU_TLB_DYN_MIN_BITS)) {
+            error_report("%s: %s", __func__, strerror(errno));
+            abort();
+        }
+        new_size = MAX(new_size >> 1, 1 << CPU_TLB_DYN_MIN_BITS);
+        env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+
+        g_free(env->tlb_table[mmu_idx]);
+        g_free(env->iotlb[mmu_idx]);
+        env->tlb_table[mmu_idx] = g_try_new(CPUTLBEntry, new_size);
+        env->iotlb[mmu_idx] = g_try_new(CPUIOTLBEntry, new_size);
+    }
+}
+
+static inline void tlb_table_flush_by_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    tlb_mmu_resize_locked(env, mmu_idx);
+    memset(env->tlb_table[mmu_idx], -1,
+           tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+    env->tlb_d[mmu_idx].n_used_entries = 0;
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, int mmu_idx)
+{
+    env->tlb_d[mmu_idx].n_used_entries++;
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, int mmu_idx)
+{
+    env->tlb_d[mmu_idx].n_used_entries--;
+}
+
+static inline void tlb_table_lock(CPUArchState *env)
+{
+    qemu_spin_lock(&env->tlb_lock);
+}
+
+static inline void tlb_table_unlock(CPUArchState *env)
+{
+    qemu_spin_unlock(&env->tlb_lock);
+}
+
+void tlb_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+
+    tlb_dyn_init(env);
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        g_free(env->tlb_table[i]);
+        g_free(env->iotlb[i]);
+        env->tlb_table[i] = NULL;
+        env->iotlb[i] = NULL;
+    }
+}
+#else
+static inline void tlb_table_flush_by_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+}
+
+static inline void tlb_n_used_entries_inc(CPUArchState *env, int mmu_idx)
+{
+}
+
+static inline void tlb_n_used_entries_dec(CPUArchState *env, int mmu_idx)
+{
+}
+
+static inline void tlb_table_lock(CPUArchState *env)
+{
+}
+
+static inline void tlb_table_unlock(CPUArchState *env)
+{
+}
+
+void tlb_init(CPUState *cpu)
+{
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+}
+#endif /* TCG_TARGET_IMPLEMENTS_DYN_TLB */
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
+}
+
 /* This is OK because CPU architectures generally permit an
  * implementation to drop entries from the TLB at any time, so
  * flushing more entries than required is only an efficiency issue,
@@ -113,6 +320,7 @@ size_t tlb_flush_count(void)
 static void tlb_flush_nocheck(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     /* The QOM tests will trigger tlb_flushes without setting up TCG
      * so we bug out here in that case.
@@ -127,7 +335,11 @@ static void tlb_flush_nocheck(CPUState *cpu)
 
     tb_lock();
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+    tlb_table_lock(env);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_table_flush_by_mmuidx(env, mmu_idx);
+    }
+    tlb_table_unlock(env);
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
     cpu_tb_jmp_cache_clear(cpu);
 
@@ -184,15 +396,17 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 
     tlb_debug("start: mmu_idx:0x%04lx\n", mmu_idx_bitmask);
 
+    tlb_table_lock(env);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
 
         if (test_bit(mmu_idx, &mmu_idx_bitmask)) {
             tlb_debug("%d\n", mmu_idx);
 
-            memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+            tlb_table_flush_by_mmuidx(env, mmu_idx);
             memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
         }
     }
+    tlb_table_unlock(env);
 
     cpu_tb_jmp_cache_clear(cpu);
 
@@ -245,7 +459,8 @@ void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
 
 
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Returns true if the entry was flushed.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -254,14 +469,129 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+/* Flush the victim TLB entry if it maps any page in [start, last].  */
+static inline void tlb_flush_vtlb_entry_range(CPUTLBEntry *tlb_entry,
+                                              target_ulong start,
+                                              target_ulong last)
+{
+    target_ulong span = last - start;
+
+    if ((tlb_entry->addr_read != -1 &&
+         (tlb_entry->addr_read & TARGET_PAGE_MASK) - start <= span) ||
+        (tlb_entry->addr_write != -1 &&
+         (tlb_entry->addr_write & TARGET_PAGE_MASK) - start <= span) ||
+        (tlb_entry->addr_code != -1 &&
+         (tlb_entry->addr_code & TARGET_PAGE_MASK) - start <= span)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
     }
 }
 
+typedef struct TLBFlushRangeData {
+    target_ulong addr;
+    target_ulong len;
+    uint16_t idxmap;
+} TLBFlushRangeData;
+
+static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
+                                              TLBFlushRangeData d)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong start = d.addr & TARGET_PAGE_MASK;
+    target_ulong last = (d.addr + d.len - 1) | ~TARGET_PAGE_MASK;
+    unsigned long idxmap = d.idxmap;
+    unsigned long full_map = 0;
+    bool covers_large_pages = false;
+    target_ulong npages, i;
+    int mmu_idx, k;
+
+    assert_cpu_is_self(cpu);
+
+    /* Invalidating any part of a large page invalidates all of it, so if
+     * the range touches the region holding large pages, grow it to cover
+     * the whole region.
+     */
+    if (env->tlb_flush_addr != (target_ulong)-1) {
+        target_ulong large_last = env->tlb_flush_addr | ~env->tlb_flush_mask;
+
+        if (start <= large_last && env->tlb_flush_addr <= last) {
+            start = MIN(start, env->tlb_flush_addr);
+            last = MAX(last, large_last);
+            covers_large_pages = true;
+        }
+    }
+    npages = ((last - start) >> TARGET_PAGE_BITS) + 1;
+
+    tlb_debug("start:"TARGET_FMT_lx" last:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
+              start, last, idxmap);
+
+    /* Past the size of the TLB it is cheaper to flush it all.  */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (test_bit(mmu_idx, &idxmap) &&
+            npages > tlb_n_entries(env, mmu_idx)) {
+            full_map |= 1 << mmu_idx;
+        }
+    }
+    if (full_map) {
+        tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(full_map));
+        idxmap &= ~full_map;
+    }
+
+    if (idxmap) {
+        for (i = 0; i < npages; i++) {
+            target_ulong page = start + (i << TARGET_PAGE_BITS);
+
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                if (test_bit(mmu_idx, &idxmap) &&
+                    tlb_flush_entry(tlb_entry(env, mmu_idx, page), page)) {
+                    tlb_n_used_entries_dec(env, mmu_idx);
+                }
+            }
+        }
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            if (test_bit(mmu_idx, &idxmap)) {
+                for (k = 0; k < CPU_VTLB_SIZE; k++) {
+                    tlb_flush_vtlb_entry_range(&env->tlb_v_table[mmu_idx][k],
+                                               start, last);
+                }
+            }
+        }
+
+        /* Each page clears two of the jump cache's buckets.  */
+        if (npages >= TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE / 2) {
+            cpu_tb_jmp_cache_clear(cpu);
+        } else {
+            for (i = 0; i < npages; i++) {
+                tb_flush_jmp_cache(cpu, start + (i << TARGET_PAGE_BITS));
+            }
+        }
+    }
+
+    /* Every entry backed by a large page has now been dropped.  */
+    if (covers_large_pages && d.idxmap == ALL_MMUIDX_BITS) {
+        env->tlb_flush_addr = -1;
+        env->tlb_flush_mask = 0;
+    }
+}
+
+static void tlb_flush_range_by_mmuidx_async_1(CPUState *cpu,
+                                              run_on_cpu_data data)
+{
+    TLBFlushRangeData *d = data.host_ptr;
+
+    tlb_flush_range_by_mmuidx_async_0(cpu, *d);
+    g_free(d);
+}
+
 static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
     target_ulong addr = (target_ulong) data.target_ptr;
-    int i;
     int mmu_idx;
 
     assert_cpu_is_self(cpu);
@@ -270,18 +600,23 @@ static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
 
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-        tlb_debug("forcing full flush ("
+        TLBFlushRangeData d = {
+            .addr = addr, .len = TARGET_PAGE_SIZE, .idxmap = ALL_MMUIDX_BITS
+        };
+
+        tlb_debug("flushing large page region ("
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu);
+        tlb_flush_range_by_mmuidx_async_0(cpu, d);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+            tlb_n_used_entries_dec(env, mmu_idx);
+        }
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
@@ -319,18 +654,19 @@ static void tlb_flush_page_by_mmuidx_async_work(CPUState *cpu,
     target_ulong addr_and_mmuidx = (target_ulong) data.target_ptr;
     target_ulong addr = addr_and_mmuidx & TARGET_PAGE_MASK;
     unsigned long mmu_idx_bitmap = addr_and_mmuidx & ALL_MMUIDX_BITS;
-    int page = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     int mmu_idx;
     int i;
 
     assert_cpu_is_self(cpu);
 
-    tlb_debug("page:%d addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
-              page, addr, mmu_idx_bitmap);
+    tlb_debug("addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
+              addr, mmu_idx_bitmap);
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         if (test_bit(mmu_idx, &mmu_idx_bitmap)) {
-            tlb_flush_entry(&env->tlb_table[mmu_idx][page], addr);
+            if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr)) {
+                tlb_n_used_entries_dec(env, mmu_idx);
+            }
 
             /* check whether there are vltb entries that need to be flushed */
             for (i = 0; i < CPU_VTLB_SIZE; i++) {
@@ -354,12 +690,15 @@ static void tlb_check_page_and_flush_by_mmuidx_async_work(CPUState *cpu,
 
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-        tlb_debug("forced full flush ("
+        TLBFlushRangeData d = {
+            .addr = addr, .len = TARGET_PAGE_SIZE, .idxmap = mmu_idx_bitmap
+        };
+
+        tlb_debug("flushing large page region ("
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush_by_mmuidx_async_work(cpu,
-                                       RUN_ON_CPU_HOST_INT(mmu_idx_bitmap));
+        tlb_flush_range_by_mmuidx_async_0(cpu, d);
     } else {
         tlb_flush_page_by_mmuidx_async_work(cpu, data);
     }
@@ -417,6 +756,26 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
     async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_TARGET_PTR(addr_and_mmu_idx));
 }
 
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    TLBFlushRangeData d = {
+        .addr = addr, .len = len, .idxmap = ALL_MMUIDX_BITS
+    };
+
+    tlb_debug("addr: "TARGET_FMT_lx" len: "TARGET_FMT_lx"\n", addr, len);
+
+    if (len == 0) {
+        return;
+    }
+
+    if (!qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_range_by_mmuidx_async_1,
+                         RUN_ON_CPU_HOST_PTR(g_memdup(&d, sizeof(d))));
+    } else {
+        tlb_flush_range_by_mmuidx_async_0(cpu, d);
+    }
+}
+
 void tlb_flush_page_all_cpus(CPUState *src, target_ulong addr)
 {
     const run_on_cpu_func fn = tlb_flush_page_async_work;
@@ -534,10 +893,13 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     int mmu_idx;
 
     env = cpu->env_ptr;
+    /* The owning vCPU may be resizing its TLBs under our feet */
+    tlb_table_lock(env);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
+        unsigned int n = tlb_n_entries(env, mmu_idx);
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        for (i = 0; i < n; i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
@@ -547,6 +909,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
     }
+    tlb_table_unlock(env);
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -561,15 +924,13 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     assert_cpu_is_self(cpu);
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -653,8 +1014,11 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    te = &env->tlb_table[mmu_idx][index];
+    index = tlb_index(env, mmu_idx, vaddr);
+    te = tlb_entry(env, mmu_idx, vaddr);
+    if (tlb_entry_is_empty(te)) {
+        tlb_n_used_entries_inc(env, mmu_idx);
+    }
     /* do not discard the translation in te, evict it into a victim tlb */
     tv = &env->tlb_v_table[mmu_idx][vidx];
 
@@ -843,6 +1207,9 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             /* Found entry in victim tlb, swap tlb and iotlb.  */
             CPUTLBEntry tmptlb, *tlb = &env->tlb_table[mmu_idx][index];
 
+            if (tlb_entry_is_empty(tlb)) {
+                tlb_n_used_entries_inc(env, mmu_idx);
+            }
             copy_tlb_helper(&tmptlb, tlb, false);
             copy_tlb_helper(tlb, vtlb, true);
             copy_tlb_helper(vtlb, &tmptlb, true);
@@ -875,12 +1242,14 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
     CPUIOTLBEntry *iotlbentry;
     hwaddr physaddr;
 
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env, true);
+    index = tlb_index(env, mmu_idx, addr);
     if (unlikely(env->tlb_table[mmu_idx][index].addr_code !=
                  (addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)))) {
         if (!VICTIM_TLB_HIT(addr_read, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, 0, MMU_INST_FETCH, mmu_idx, 0);
+            /* tlb_fill may have flushed, and thus resized, the TLB.  */
+            index = tlb_index(env, mmu_idx, addr);
         }
     }
     iotlbentry = &env->iotlb[mmu_idx][index];
@@ -931,7 +1300,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env, target_ulong addr)
 void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
                  uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
 
     if ((addr & TARGET_PAGE_MASK)
@@ -951,8 +1320,8 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
                                NotDirtyInfo *ndi)
 {
     size_t mmu_idx = get_mmuidx(oi);
-    size_t index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
+    size_t index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *tlbe = tlb_entry(env, mmu_idx, addr);
     target_ulong tlb_addr = tlbe->addr_write;
     TCGMemOp mop = get_memop(oi);
     int a_bits = get_alignment_bits(mop);
@@ -984,6 +1353,9 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
         if (!VICTIM_TLB_HIT(addr_write, addr)) {
             tlb_fill(ENV_GET_CPU(env), addr, 1 << s_bits, MMU_DATA_STORE,
                      mmu_idx, retaddr);
+            /* tlb_fill may have flushed, and thus resized, the TLB.  */
+            index = tlb_index(env, mmu_idx, addr);
+            tlbe = tlb_entry(env, mmu_idx, addr);
         }
         tlb_addr = tlbe->addr_write & ~TLB_INVALID_MASK;
     }
@@ -167,3 +167,8 @@ void HELPER(exit_atomic)(CPUArchState *env)
 {
     cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
 }
+
+void HELPER(tb_hot)(CPUArchState *env, void *tb)
+{
+    cpu_superblock_recompile(ENV_GET_CPU(env), tb, GETPC());
+}
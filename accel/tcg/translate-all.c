@@ -156,6 +156,8 @@ TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
 TBContext tb_ctx;
 bool parallel_cpus;
+/* Retranslate hot TBs as superblocks; set from the accelerator options */
+bool tcg_superblocks_enabled;
 
 /* translation block context */
 static __thread int have_tb_lock;
@@ -887,17 +889,10 @@ static gboolean tb_host_size_iter(gpointer key, gpointer value, gpointer data)
     return false;
 }
 
-/* flush all the translation blocks */
-static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+/* flush all the translation blocks; called with tb_lock held */
+static void tb_flush__locked(void)
 {
-    tb_lock();
-
-    /* If it is already been done on request of another CPU,
-     * just retry.
-     */
-    if (tb_ctx.tb_flush_count != tb_flush_count.host_int) {
-        goto done;
-    }
+    CPUState *cpu;
 
     if (DEBUG_TB_FLUSH_GATE) {
         size_t nb_tbs = g_tree_nnodes(tb_ctx.tb_tree);
@@ -923,6 +918,19 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     atomic_mb_set(&tb_ctx.tb_flush_count, tb_ctx.tb_flush_count + 1);
+}
+
+static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
+{
+    tb_lock();
+
+    /* If it is already been done on request of another CPU,
+     * just retry.
+     */
+    if (tb_ctx.tb_flush_count != tb_flush_count.host_int) {
+        goto done;
+    }
+    tb_flush__locked();
 
 done:
     tb_unlock();
@@ -937,6 +945,113 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+static bool do_tb_phys_invalidate(TranslationBlock *tb,
+                                  tb_page_addr_t page_addr);
+
+struct tb_evict_data {
+    void *start;
+    void *end;
+    GPtrArray *tbs;
+};
+
+static gboolean tb_evict_collect_iter(gpointer key, gpointer value,
+                                      gpointer data)
+{
+    const struct tb_tc *tc = key;
+    struct tb_evict_data *d = data;
+
+    /* tb_tree is sorted by host address, so stop once past the region */
+    if ((void *)tc->ptr >= d->end) {
+        return true;
+    }
+    if ((void *)tc->ptr >= d->start) {
+        g_ptr_array_add(d->tbs, value);
+    }
+    return false;
+}
+
+/*
+ * Drop all TBs whose code lies in [start, end). The TB structs live right
+ * before their code, so once this returns nothing refers to the range.
+ */
+static void tb_evict_range(void *start, void *end)
+{
+    struct tb_evict_data d = {
+        .start = start,
+        .end = end,
+        .tbs = g_ptr_array_new(),
+    };
+    guint i;
+
+    g_tree_foreach(tb_ctx.tb_tree, tb_evict_collect_iter, &d);
+
+    for (i = 0; i < d.tbs->len; i++) {
+        TranslationBlock *tb = g_ptr_array_index(d.tbs, i);
+
+        /*
+         * TBs that were invalidated earlier are no longer in the QHT or in
+         * any list, but they still have to be removed from tb_tree.
+         */
+        do_tb_phys_invalidate(tb, -1);
+        tb_remove(tb);
+    }
+    tb_ctx.tb_evict_tb_count += d.tbs->len;
+
+    if (DEBUG_TB_FLUSH_GATE) {
+        printf("qemu: evict region %p-%p nb_tbs=%u\n", start, end, d.tbs->len);
+    }
+    g_ptr_array_free(d.tbs, true);
+}
+
+/*
+ * Make room in code_gen_buffer by evicting its coldest region. The per-vCPU
+ * jump caches hold the TBs that have been executed most recently, so they
+ * are used to estimate how hot each region is. If there is no region that
+ * can be evicted, flush everything.
+ */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_gen)
+{
+    size_t *hits;
+    size_t i;
+
+    tb_lock();
+
+    /* Space may already have been made on request of another CPU */
+    if (tb_ctx.tb_flush_count + tb_ctx.tb_evict_count != tb_gen.host_int) {
+        goto done;
+    }
+
+    hits = g_new0(size_t, tcg_region_count());
+    CPU_FOREACH(cpu) {
+        for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+            TranslationBlock *tb = atomic_read(&cpu->tb_jmp_cache[i]);
+
+            if (tb) {
+                hits[tcg_region_index(tb->tc.ptr)]++;
+            }
+        }
+    }
+
+    if (tcg_region_evict(hits, tb_evict_range)) {
+        atomic_mb_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+    } else {
+        tb_flush__locked();
+    }
+    g_free(hits);
+
+done:
+    tb_unlock();
+}
+
+/* Like tb_flush, but only drops as much code as needed to make room */
+static void tb_evict(CPUState *cpu)
+{
+    unsigned tb_gen = atomic_mb_read(&tb_ctx.tb_flush_count) +
+                      atomic_mb_read(&tb_ctx.tb_evict_count);
+
+    async_safe_run_on_cpu(cpu, do_tb_evict, RUN_ON_CPU_HOST_INT(tb_gen));
+}
+
 /*
  * Formerly ifdef DEBUG_TB_CHECK. These debug functions are user-mode-only,
  * so in order to prevent bit rot we compile them unconditionally in user-mode,
@@ -1065,11 +1180,12 @@ static inline void tb_jmp_unlink(TranslationBlock *tb)
     }
 }
 
-/* invalidate one TB
+/* invalidate one TB; returns false if it had already been invalidated
  *
  * Called with tb_lock held.
  */
-void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+static bool do_tb_phys_invalidate(TranslationBlock *tb,
+                                  tb_page_addr_t page_addr)
 {
     CPUState *cpu;
     PageDesc *p;
@@ -1085,7 +1201,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cflags & CF_HASH_MASK,
                      tb->trace_vcpu_dstate);
     if (!qht_remove(&tb_ctx.htable, tb, h)) {
-        return;
+        return false;
     }
 
     /* remove the TB from the page list */
@@ -1114,8 +1230,15 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* suppress any remaining jumps to this TB */
     tb_jmp_unlink(tb);
+    return true;
+}
 
-    tb_ctx.tb_phys_invalidate_count++;
+/* Called with tb_lock held.  */
+void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
+{
+    if (do_tb_phys_invalidate(tb, page_addr)) {
+        tb_ctx.tb_phys_invalidate_count++;
+    }
 }
 
 #ifdef CONFIG_SOFTMMU
@@ -1262,8 +1385,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  buffer_overflow:
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* make room by evicting old code, or by flushing everything */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1277,6 +1400,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->flags = flags;
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->exec_count = 0;
+    /* Known early so that superblock formation can look up other TBs */
+    tb->page_addr[0] = phys_pc == -1 ? -1 : phys_pc & TARGET_PAGE_MASK;
     tcg_ctx->tb_cflags = cflags;
 
 #ifdef CONFIG_PROFILER
@@ -1802,6 +1928,33 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     cpu_loop_exit_noexc(cpu);
 }
 
+/*
+ * Called from the code of @tb once it has been entered TB_HOT_THRESHOLD
+ * times: replace it with a superblock that the frontend extends along the
+ * hot path, and restart execution from the start of @tb.
+ */
+void cpu_superblock_recompile(CPUState *cpu, TranslationBlock *tb,
+                              uintptr_t retaddr)
+{
+    /* nothing in @tb has been executed yet besides the counter update */
+    cpu_restore_state(cpu, retaddr);
+
+    mmap_lock();
+    tb_lock();
+    /* another vCPU may have beaten us to it */
+    if (!(tb_cflags(tb) & CF_INVALID)) {
+        uint32_t cflags = (tb->cflags & CF_HASH_MASK) | CF_SUPERBLOCK;
+
+        tb_phys_invalidate(tb, -1);
+        tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags, cflags);
+        tb_ctx.tb_superblock_count++;
+    }
+    tb_unlock();
+    mmap_unlock();
+
+    cpu_loop_exit_noexc(cpu);
+}
+
 static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
 {
     unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr);
@@ -1914,6 +2067,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB avg host size    %zu bytes (expansion ratio: %0.1f)\n",
                 nb_tbs ? tst.host_size / nb_tbs : 0,
                 tst.target_size ? (double)tst.host_size / tst.target_size : 0);
+    cpu_fprintf(f, "code regions        %zu\n", tcg_region_count());
     cpu_fprintf(f, "cross page TB count %zu (%zu%%)\n", tst.cross_page,
             nb_tbs ? (tst.cross_page * 100) / nb_tbs : 0);
     cpu_fprintf(f, "direct jump count   %zu (%zu%%) (2 jumps=%zu %zu%%)\n",
@@ -1929,6 +2083,9 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %u\n",
                 atomic_read(&tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "superblock count    %zu\n", tb_ctx.tb_superblock_count);
+    cpu_fprintf(f, "TB evict count      %u (%zu TBs)\n",
+                atomic_read(&tb_ctx.tb_evict_count), tb_ctx.tb_evict_tb_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %zu\n", tlb_flush_count());
     tcg_dump_info(f, cpu_fprintf);
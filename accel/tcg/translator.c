@@ -31,9 +31,53 @@ void translator_loop_temp_check(DisasContextBase *db)
     }
 }
 
+bool translator_prefer_taken(const DisasContextBase *db,
+                             target_ulong taken, target_ulong not_taken)
+{
+    return tb_exec_count_hint(db->tb, taken) >
+           tb_exec_count_hint(db->tb, not_taken);
+}
+
+/*
+ * Count how many times the TB is entered, and have it retranslated as a
+ * superblock once it is hot. This is emitted right after the first
+ * insn_start, so that the helper can restore the state at the start of
+ * the TB.
+ */
+static void gen_tb_exec_count(TranslationBlock *tb)
+{
+    TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+    TCGv_i32 count = tcg_temp_new_i32();
+    TCGLabel *l = gen_new_label();
+
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, count, TB_HOT_THRESHOLD, l);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+
+    ptr = tcg_const_ptr(tb);
+    gen_helper_tb_hot(cpu_env, ptr);
+    tcg_temp_free_ptr(ptr);
+    gen_set_label(l);
+}
+
+static bool translator_count_exec(const DisasContextBase *db, int max_insns)
+{
+#ifdef TCG_GUEST_SUPERBLOCKS
+    return tcg_superblocks_enabled && max_insns > 1 &&
+           !(tb_cflags(db->tb) & (CF_SUPERBLOCK | CF_NOCACHE | CF_LAST_IO |
+                                  CF_USE_ICOUNT | CF_COUNT_MASK));
+#else
+    return false;
+#endif
+}
+
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb)
 {
+    bool count_exec;
     int max_insns;
 
     /* Initialize DisasContext */
@@ -58,11 +102,19 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
     max_insns = ops->init_disas_context(db, cpu, max_insns);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
+    count_exec = translator_count_exec(db, max_insns);
 
     /* Reset the temp count so that we can identify leaks */
     tcg_clear_temp_count();
 
-    /* Start translating.  */
+    /* Start translating.  Branches back to the head of a superblock go
+       through the exit request check of gen_tb_start, so a loop within
+       the TB still leaves it for interrupts and exit requests.  */
+    db->loop_head = NULL;
+    if (tb_cflags(db->tb) & CF_SUPERBLOCK) {
+        db->loop_head = gen_new_label();
+        gen_set_label(db->loop_head);
+    }
     gen_tb_start(db->tb);
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
@@ -72,6 +124,10 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
         ops->insn_start(db, cpu);
         tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
+        if (count_exec && db->num_insns == 1) {
+            gen_tb_exec_count(db->tb);
+        }
+
         /* Pass breakpoint hits to target for further processing */
         if (unlikely(!QTAILQ_EMPTY(&cpu->breakpoints))) {
             CPUBreakpoint *bp;
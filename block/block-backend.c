@@ -75,6 +75,13 @@ struct BlockBackend {
 
     bool allow_write_beyond_eof;
 
+    /* If true, aio requests are submitted and completed in the AioContext of
+     * the calling thread rather than in the AioContext of the root node.
+     * The caller is responsible for making that safe; see
+     * blk_set_multiqueue().
+     */
+    bool multiqueue;
+
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
@@ -1347,6 +1354,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
 {
     BlkAioEmAIOCB *acb;
     Coroutine *co;
+    AioContext *ctx;
 
     blk_inc_in_flight(blk);
     acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
@@ -1361,12 +1369,17 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    if (blk->multiqueue) {
+        ctx = qemu_get_current_aio_context();
+        aio_co_enter(ctx, co);
+    } else {
+        ctx = blk_get_aio_context(blk);
+        bdrv_coroutine_enter(blk_bs(blk), co);
+    }
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
-                                blk_aio_complete_bh, acb);
+        aio_bh_schedule_oneshot(ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -1896,6 +1909,37 @@ void blk_set_aio_context(BlockBackend *blk, AioContext *new_context)
     }
 }
 
+/*
+ * Return whether requests may be submitted to @blk from several AioContexts
+ * at once.  This is only the case when the root node is a protocol driver
+ * that supports it, with no format or filter driver on top, and when I/O
+ * throttling is not in use.
+ */
+bool blk_supports_multiqueue(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    return bs && bs->drv && bs->drv->supports_multiqueue &&
+           !blk->public.throttle_group_member.throttle_state;
+}
+
+/*
+ * Allow aio requests to be submitted from several AioContexts at once.  Each
+ * request then runs and completes in the AioContext of the thread that
+ * submitted it, instead of being funneled through the AioContext of the root
+ * node.  Callers must check blk_supports_multiqueue() first; this is only
+ * meant for devices that process virtqueues in several IOThreads.
+ *
+ * blk_io_plug() and blk_io_unplug() do nothing while multiqueue is enabled:
+ * the plug state of the root node is shared, while each AioContext submits
+ * to its own queue.
+ */
+void blk_set_multiqueue(BlockBackend *blk, bool multiqueue)
+{
+    assert(!multiqueue || blk_supports_multiqueue(blk));
+    blk->multiqueue = multiqueue;
+}
+
 void blk_add_aio_context_notifier(BlockBackend *blk,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
@@ -1956,7 +2000,7 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
-    if (bs) {
+    if (bs && !blk->multiqueue) {
         bdrv_io_plug(bs);
     }
 }
@@ -1965,7 +2009,7 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
-    if (bs) {
+    if (bs && !blk->multiqueue) {
         bdrv_io_unplug(bs);
     }
 }
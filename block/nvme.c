@@ -29,6 +29,9 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+/* Queue identifiers are 16 bit, but the doorbells of all queues must fit into
+ * the mapped BAR (two doorbells per queue pair, at least 4 bytes each). */
+#define NVME_MAX_QUEUES ((NVME_BAR_SIZE - 0x1000) / 8)
 
 typedef struct {
     int32_t  head, tail;
@@ -41,6 +44,8 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    /* If non-NULL, receives dword 0 of the completion queue entry */
+    uint32_t *result;
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -55,6 +60,10 @@ typedef struct {
     int         index;
     uint8_t     *prp_list_pages;
 
+    /* The AioContext that submits to this I/O queue, claimed atomically on
+     * first use by nvme_get_io_queue().  NULL while the queue is unused. */
+    AioContext  *ctx;
+
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
     int         cq_phase;
@@ -106,6 +115,10 @@ typedef struct {
     uint64_t max_transfer;
     int plugged;
 
+    /* Number of I/O queue pairs requested by the user, limited to what the
+     * controller granted */
+    int num_io_queues;
+
     CoMutex dma_map_lock;
     CoQueue dma_flush_queue;
 
@@ -115,6 +128,7 @@ typedef struct {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -130,6 +144,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -224,7 +243,7 @@ fail:
 /* With q->lock */
 static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
 {
-    if (s->plugged || !q->need_kick) {
+    if (atomic_read(&s->plugged) || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -302,7 +321,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (q->busy || s->plugged) {
+    if (q->busy || atomic_read(&s->plugged)) {
         trace_nvme_process_completion_queue_busy(s, q->index);
         return false;
     }
@@ -330,8 +349,12 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         preq->busy = false;
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, nvme_translate_error(c));
         qemu_mutex_lock(&q->lock);
@@ -392,8 +415,8 @@ static void nvme_cmd_sync_cb(void *opaque, int ret)
     *pret = ret;
 }
 
-static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
-                         NvmeCmd *cmd)
+static int nvme_cmd_sync_result(BlockDriverState *bs, NVMeQueuePair *q,
+                                NvmeCmd *cmd, uint32_t *result)
 {
     NVMeRequest *req;
     BDRVNVMeState *s = bs->opaque;
@@ -402,12 +425,19 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
 
     BDRV_POLL_WHILE(bs, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    return nvme_cmd_sync_result(bs, q, cmd, NULL);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -495,6 +525,31 @@ static void nvme_handle_event(EventNotifier *n)
     aio_context_release(s->aio_context);
 }
 
+/* Ask the controller for @nr_io_queues I/O queue pairs and return how many
+ * it granted.  Controllers may allocate fewer than requested, and creating
+ * queues beyond the grant fails. */
+static int nvme_set_num_queues(BlockDriverState *bs, int nr_io_queues)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint32_t result = 0;
+    int granted;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) | (nr_io_queues - 1)),
+    };
+
+    if (nvme_cmd_sync_result(bs, s->queues[0], &cmd, &result)) {
+        trace_nvme_set_num_queues_failed(s, nr_io_queues);
+        return 1;
+    }
+    /* Dword 0 holds the zero-based numbers of submission (bits 15:0) and
+     * completion (bits 31:16) queues allocated. */
+    granted = MIN(result & 0xFFFF, result >> 16) + 1;
+    trace_nvme_set_num_queues(s, nr_io_queues, granted);
+    return MIN(nr_io_queues, granted);
+}
+
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -547,7 +602,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     int ret;
@@ -559,6 +614,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
     s->nsid = namespace;
+    s->num_io_queues = num_queues;
     s->aio_context = bdrv_get_aio_context(bs);
     ret = event_notifier_init(&s->irq_notifier, 0);
     if (ret) {
@@ -590,6 +646,10 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     s->page_size = MAX(4096, 1 << (12 + ((cap >> 48) & 0xF)));
     s->doorbell_scale = (4 << (((cap >> 32) & 0xF))) / sizeof(uint32_t);
+    /* The doorbells of all queue pairs, including the admin queue, must lie
+     * within the mapped BAR. */
+    s->num_io_queues = MAX(1, MIN(s->num_io_queues,
+                                  NVME_MAX_QUEUES / s->doorbell_scale - 1));
     bs->bl.opt_mem_alignment = s->page_size;
     timeout_ms = MIN(500 * ((cap >> 24) & 0xFF), 30000);
 
@@ -653,10 +713,22 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
+    s->num_io_queues = nvme_set_num_queues(bs, s->num_io_queues);
     if (!nvme_add_io_queue(bs, errp)) {
         ret = -EIO;
         goto fail_handler;
     }
+    while (s->nr_queues - 1 < s->num_io_queues) {
+        /* Additional queues are best effort.  If one cannot be created,
+         * AioContexts without a queue of their own share the first one. */
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            trace_nvme_io_queue_limit(s, s->nr_queues - 1,
+                                      error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            break;
+        }
+    }
     return 0;
 
 fail_handler:
@@ -752,6 +824,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -765,7 +838,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues >= NVME_MAX_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_QUEUES - 1);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -902,20 +982,49 @@ typedef struct {
     AioContext *ctx;
 } NVMeCoData;
 
+/* Select the I/O queue for requests submitted from the current AioContext.
+ *
+ * Each AioContext claims an I/O queue pair of its own the first time it
+ * submits a request, so that iothreads do not contend on the same submission
+ * queue lock and doorbell.  Once all queues are claimed, further AioContexts
+ * share the first I/O queue.  Claims are dropped in nvme_detach_aio_context(),
+ * while the node is drained.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    int i;
+
+    assert(s->nr_queues > 1);
+    for (i = 1; i < s->nr_queues; i++) {
+        if (atomic_read(&s->queues[i]->ctx) == ctx) {
+            return s->queues[i];
+        }
+    }
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        if (!atomic_read(&q->ctx) && !atomic_cmpxchg(&q->ctx, NULL, ctx)) {
+            trace_nvme_claim_io_queue(s, q->index, ctx);
+            return q;
+        }
+    }
+    return s->queues[1];
+}
+
 static void nvme_rw_cb_bh(void *opaque)
 {
     NVMeCoData *data = opaque;
     qemu_coroutine_enter(data->co);
 }
 
+/* Completions may be processed in the BDS AioContext or synchronously from
+ * nvme_submit_command(); either way the submitting coroutine is entered from
+ * a BH in its own AioContext, after it has yielded.
+ */
 static void nvme_rw_cb(void *opaque, int ret)
 {
     NVMeCoData *data = opaque;
     data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
-    }
     aio_bh_schedule_oneshot(data->ctx, nvme_rw_cb_bh, data);
 }
 
@@ -927,7 +1036,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     uint32_t cdw12 = (((bytes >> BDRV_SECTOR_BITS) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -939,7 +1048,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -957,10 +1067,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     }
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
 
-    data.co = qemu_coroutine_self();
-    while (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    qemu_coroutine_yield();
+    assert(data.ret != -EINPROGRESS);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
     r = nvme_cmd_unmap_qiov(bs, qiov);
@@ -1041,14 +1149,15 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1057,10 +1166,8 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
     assert(req);
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
 
-    data.co = qemu_coroutine_self();
-    if (data.ret == -EINPROGRESS) {
-        qemu_coroutine_yield();
-    }
+    qemu_coroutine_yield();
+    assert(data.ret != -EINPROGRESS);
 
     return data.ret;
 }
@@ -1098,9 +1205,16 @@ static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
 static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
+    int i;
 
     aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
                            false, NULL, NULL);
+
+    /* No requests are in flight; let the AioContexts that submit after the
+     * move claim the I/O queues afresh. */
+    for (i = 1; i < s->nr_queues; i++) {
+        atomic_set(&s->queues[i]->ctx, NULL);
+    }
 }
 
 static void nvme_attach_aio_context(BlockDriverState *bs,
@@ -1116,15 +1230,15 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
 static void nvme_aio_plug(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    s->plugged++;
+    atomic_inc(&s->plugged);
 }
 
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
     int i;
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    if (!--s->plugged) {
+    assert(atomic_read(&s->plugged));
+    if (atomic_fetch_dec(&s->plugged) == 1) {
         for (i = 1; i < s->nr_queues; i++) {
             NVMeQueuePair *q = s->queues[i];
             qemu_mutex_lock(&q->lock);
@@ -1163,6 +1277,7 @@ static BlockDriver bdrv_nvme = {
 
     .bdrv_parse_filename      = nvme_parse_filename,
     .bdrv_file_open           = nvme_file_open,
+    .supports_multiqueue      = true,
     .bdrv_close               = nvme_close,
     .bdrv_getlength           = nvme_getlength,
 
@@ -218,6 +218,20 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+/*
+ * Like l2_load(), but only returns the slice if it is already cached.  No
+ * reference is taken, so the slice may only be used until the next yield.
+ */
+static uint64_t *l2_peek(BlockDriverState *bs, uint64_t offset,
+                         uint64_t l2_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int start_of_slice = sizeof(uint64_t) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+
+    return qcow2_cache_peek(s->l2_table_cache, l2_offset + start_of_slice);
+}
+
 /*
  * Writes one sector of the L1 table to the disk (can't update single entries
  * and we really don't want bdrv_pread to perform a read-modify-write)
@@ -524,9 +538,13 @@ static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
+ *
+ * If @nolock is true, s->lock is not held and only L2 slices that are already
+ * cached are used; see qcow2_get_cluster_offset_nolock().
  */
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-                             unsigned int *bytes, uint64_t *cluster_offset)
+static int do_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+                                 unsigned int *bytes, uint64_t *cluster_offset,
+                                 bool nolock)
 {
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
@@ -568,6 +586,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     }
 
     if (offset_into_cluster(s, l2_offset)) {
+        if (nolock) {
+            return -EAGAIN;
+        }
         qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#" PRIx64
                                 " unaligned (L1 index: %#" PRIx64 ")",
                                 l2_offset, l1_index);
@@ -576,9 +597,16 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 slice in memory */
 
-    ret = l2_load(bs, offset, l2_offset, &l2_slice);
-    if (ret < 0) {
-        return ret;
+    if (nolock) {
+        l2_slice = l2_peek(bs, offset, l2_offset);
+        if (!l2_slice) {
+            return -EAGAIN;
+        }
+    } else {
+        ret = l2_load(bs, offset, l2_offset, &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* find the cluster offset for the given disk offset */
@@ -593,6 +621,13 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     assert(nb_clusters <= INT_MAX);
 
     type = qcow2_get_cluster_type(*cluster_offset);
+    if (nolock && (type == QCOW2_CLUSTER_COMPRESSED ||
+                   (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
+                                            type == QCOW2_CLUSTER_ZERO_ALLOC)) ||
+                   offset_into_cluster(s, *cluster_offset & L2E_OFFSET_MASK))) {
+        /* Leave compressed clusters and error reporting to the slow path */
+        return -EAGAIN;
+    }
     if (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
                                 type == QCOW2_CLUSTER_ZERO_ALLOC)) {
         qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
@@ -634,7 +669,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         abort();
     }
 
-    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    if (!nolock) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
 
     bytes_available = (int64_t)c * s->cluster_size;
 
@@ -656,6 +693,36 @@ fail:
     return ret;
 }
 
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+                             unsigned int *bytes, uint64_t *cluster_offset)
+{
+    return do_get_cluster_offset(bs, offset, bytes, cluster_offset, false);
+}
+
+/*
+ * qcow2_get_cluster_offset_nolock
+ *
+ * Same as qcow2_get_cluster_offset(), but may be called without s->lock.
+ *
+ * This works because the function never yields and only looks at L2 slices
+ * that are already in the cache, so it sees the metadata as the coroutines
+ * that modify it leave it whenever they yield.  Those keep the cached L2
+ * slices consistent across yields: a new L2 table is only linked into the
+ * L1 table after it has been filled, L2 entries of newly allocated clusters
+ * are only set once their data has been written, and a slice that is being
+ * read from disk is not in the cache index until the read has completed.
+ *
+ * Returns -EAGAIN if the lookup needs the slow path, i.e. if the L2 slice is
+ * not cached, the cluster is compressed or the metadata looks corrupted.
+ * The caller must then take s->lock and call qcow2_get_cluster_offset().
+ */
+int qcow2_get_cluster_offset_nolock(BlockDriverState *bs, uint64_t offset,
+                                    unsigned int *bytes,
+                                    uint64_t *cluster_offset)
+{
+    return do_get_cluster_offset(bs, offset, bytes, cluster_offset, true);
+}
+
 /*
  * get_cluster_table
  *
@@ -1716,9 +1716,12 @@ static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
     int status = 0;
 
     bytes = MIN(INT_MAX, count);
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_get_cluster_offset(bs, offset, &bytes, &cluster_offset);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_get_cluster_offset_nolock(bs, offset, &bytes, &cluster_offset);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_cluster_offset(bs, offset, &bytes, &cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -1755,8 +1758,6 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (bytes != 0) {
 
         /* prepare next request */
@@ -1766,7 +1767,16 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
+        /* Clusters whose L2 slice is cached are mapped without s->lock, so
+         * that reads don't queue up behind allocating writes */
+        ret = qcow2_get_cluster_offset_nolock(bs, offset, &cur_bytes,
+                                              &cluster_offset);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes,
+                                           &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1781,10 +1791,8 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 
             if (bs->backing) {
                 BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_preadv(bs->backing, offset, cur_bytes,
                                      &hd_qiov, 0);
-                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto fail;
                 }
@@ -1801,14 +1809,29 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 
         case QCOW2_CLUSTER_COMPRESSED:
             /* add AIO support for compressed blocks ? */
+            qemu_co_mutex_lock(&s->lock);
+            /* The mapping was looked up without s->lock held across; a
+             * concurrent write may have copied the cluster and freed the
+             * compressed data since.  Redo the lookup under the lock. */
+            ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes,
+                                           &cluster_offset);
+            if (ret != QCOW2_CLUSTER_COMPRESSED) {
+                qemu_co_mutex_unlock(&s->lock);
+                if (ret < 0) {
+                    goto fail;
+                }
+                continue;
+            }
             ret = qcow2_decompress_cluster(bs, cluster_offset);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
                                 s->cluster_cache + offset_in_cluster,
                                 cur_bytes);
+            qemu_co_mutex_unlock(&s->lock);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1841,11 +1864,9 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_preadv(bs->file,
                                  cluster_offset + offset_in_cluster,
                                  cur_bytes, &hd_qiov, 0);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -1880,8 +1901,6 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
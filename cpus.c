@@ -224,6 +224,14 @@ void qemu_tcg_configure(QemuOpts *opts, Error **errp)
     } else {
         mttcg_enabled = default_mttcg_enabled();
     }
+
+    if (qemu_opt_get_bool(opts, "superblocks", false)) {
+#ifdef TCG_GUEST_SUPERBLOCKS
+        tcg_superblocks_enabled = true;
+#else
+        error_setg(errp, "TCG superblocks are not supported by this target");
+#endif
+    }
 }
 
 /* The current number of executed instructions is based on what we
@@ -772,6 +772,11 @@ void cpu_exec_unrealizefn(CPUState *cpu)
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
         vmstate_unregister(NULL, &vmstate_cpu_common, cpu);
     }
+#ifndef CONFIG_USER_ONLY
+    if (tcg_enabled()) {
+        tlb_destroy(cpu);
+    }
+#endif
 }
 
 Property cpu_common_props[] = {
@@ -813,6 +818,10 @@ void cpu_exec_realizefn(CPUState *cpu, Error **errp)
     }
 
 #ifndef CONFIG_USER_ONLY
+    if (tcg_enabled()) {
+        tlb_init(cpu);
+    }
+
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
         vmstate_register(NULL, cpu->cpu_index, &vmstate_cpu_common, cpu);
     }
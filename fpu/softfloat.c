@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <math.h>
+#include <float.h>
 #include "qemu/bitops.h"
 #include "fpu/softfloat.h"
 
@@ -722,6 +724,75 @@ static FloatParts addsub_floats(FloatParts a, FloatParts b, bool subtract,
     g_assert_not_reached();
 }
 
+/*
+ * Hardfloat
+ *
+ * The float32 and float64 add, sub, mul, div, muladd and sqrt below
+ * first try to compute the result with the host FPU, which is an order
+ * of magnitude faster than the emulation.  This is only done when the
+ * host result and flags are known to match softfloat's:
+ *
+ * - the rounding mode is nearest-even, which is what the host uses;
+ * - the inexact flag is already set.  Computing it would mean reading
+ *   the host's exception flags, which costs more than it saves, but
+ *   guests rarely clear it, so once set there is nothing to report;
+ * - the inputs are zero or normal (after flush_inputs_to_zero), so no
+ *   NaN can come in or out and there is nothing to raise for invalid
+ *   or divide-by-zero;
+ * - overflow is seen as an infinite result, while a result that may be
+ *   tiny is recomputed by softfloat, which knows about underflow,
+ *   tininess detection and flush_to_zero.
+ *
+ * Everything else falls back to the softfloat implementation.  The
+ * fast path is compiled out if the host does not evaluate float and
+ * double at their own precision (e.g. x87), or with -ffast-math.
+ */
+#if defined(__FAST_MATH__) || FLT_EVAL_METHOD != 0
+# define QEMU_NO_HARDFLOAT 1
+# define QEMU_SOFTFLOAT_ATTR __attribute__((flatten))
+#else
+# define QEMU_NO_HARDFLOAT 0
+/* Keep the slow path out of line so that the fast path stays small */
+# define QEMU_SOFTFLOAT_ATTR __attribute__((flatten, noinline))
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_fpu(const float_status *s)
+{
+    if (QEMU_NO_HARDFLOAT) {
+        return false;
+    }
+    return likely(s->float_exception_flags & float_flag_inexact &&
+                  s->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline void float32_input_flush2(float32 *a, float32 *b,
+                                        float_status *s)
+{
+    if (unlikely(s->flush_inputs_to_zero)) {
+        *a = float32_squash_input_denormal(*a, s);
+        *b = float32_squash_input_denormal(*b, s);
+    }
+}
+
+static inline void float64_input_flush2(float64 *a, float64 *b,
+                                        float_status *s)
+{
+    if (unlikely(s->flush_inputs_to_zero)) {
+        *a = float64_squash_input_denormal(*a, s);
+        *b = float64_squash_input_denormal(*b, s);
+    }
+}
+
 /*
  * Returns the result of adding or subtracting the floating-point
  * values `a' and `b'. The operation is performed according to the
@@ -738,8 +809,8 @@ float16  __attribute__((flatten)) float16_add(float16 a, float16 b,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
-                                             float_status *status)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_add(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -748,8 +819,8 @@ float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_add(float64 a, float64 b,
-                                             float_status *status)
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_add(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -768,8 +839,8 @@ float16 __attribute__((flatten)) float16_sub(float16 a, float16 b,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
-                                             float_status *status)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_sub(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -778,8 +849,8 @@ float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
-                                             float_status *status)
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_sub(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -788,6 +859,88 @@ float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
     return float64_round_pack_canonical(pr, status);
 }
 
+static inline float32 float32_addsub(float32 a, float32 b, bool subtract,
+                                    float_status *s)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    float32_input_flush2(&a, &b, s);
+    if (unlikely(!float32_is_zero_or_normal(a) ||
+                 !float32_is_zero_or_normal(b))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    ur.h = subtract ? ua.h - ub.h : ua.h + ub.h;
+    if (unlikely(float32_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !(float32_is_zero(a) && float32_is_zero(b))) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return subtract ? soft_f32_sub(a, b, s) : soft_f32_add(a, b, s);
+}
+
+float32 __attribute__((flatten)) float32_add(float32 a, float32 b,
+                                             float_status *status)
+{
+    return float32_addsub(a, b, false, status);
+}
+
+float32 __attribute__((flatten)) float32_sub(float32 a, float32 b,
+                                             float_status *status)
+{
+    return float32_addsub(a, b, true, status);
+}
+
+static inline float64 float64_addsub(float64 a, float64 b, bool subtract,
+                                    float_status *s)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    float64_input_flush2(&a, &b, s);
+    if (unlikely(!float64_is_zero_or_normal(a) ||
+                 !float64_is_zero_or_normal(b))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    ur.h = subtract ? ua.h - ub.h : ua.h + ub.h;
+    if (unlikely(float64_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !(float64_is_zero(a) && float64_is_zero(b))) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return subtract ? soft_f64_sub(a, b, s) : soft_f64_add(a, b, s);
+}
+
+float64 __attribute__((flatten)) float64_add(float64 a, float64 b,
+                                             float_status *status)
+{
+    return float64_addsub(a, b, false, status);
+}
+
+float64 __attribute__((flatten)) float64_sub(float64 a, float64 b,
+                                             float_status *status)
+{
+    return float64_addsub(a, b, true, status);
+}
+
 /*
  * Returns the result of multiplying the floating-point values `a' and
  * `b'. The operation is performed according to the IEC/IEEE Standard
@@ -849,8 +1002,8 @@ float16 __attribute__((flatten)) float16_mul(float16 a, float16 b,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
-                                             float_status *status)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_mul(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -859,8 +1012,8 @@ float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
-                                             float_status *status)
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_mul(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -869,6 +1022,64 @@ float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
     return float64_round_pack_canonical(pr, status);
 }
 
+float32 __attribute__((flatten)) float32_mul(float32 a, float32 b,
+                                             float_status *s)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    float32_input_flush2(&a, &b, s);
+    if (unlikely(!float32_is_zero_or_normal(a) ||
+                 !float32_is_zero_or_normal(b))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h * ub.h;
+    if (unlikely(float32_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !float32_is_zero(a) && !float32_is_zero(b)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft_f32_mul(a, b, s);
+}
+
+float64 __attribute__((flatten)) float64_mul(float64 a, float64 b,
+                                             float_status *s)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    float64_input_flush2(&a, &b, s);
+    if (unlikely(!float64_is_zero_or_normal(a) ||
+                 !float64_is_zero_or_normal(b))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h * ub.h;
+    if (unlikely(float64_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !float64_is_zero(a) && !float64_is_zero(b)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft_f64_mul(a, b, s);
+}
+
 /*
  * Returns the result of multiplying the floating-point values `a' and
  * `b' then adding 'c', with no intermediate rounding step after the
@@ -1084,8 +1295,9 @@ float16 __attribute__((flatten)) float16_muladd(float16 a, float16 b, float16 c,
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
-                                                int flags, float_status *status)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_muladd(float32 a, float32 b, float32 c, int flags,
+               float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -1095,8 +1307,9 @@ float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_muladd(float64 a, float64 b, float64 c,
-                                                int flags, float_status *status)
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_muladd(float64 a, float64 b, float64 c, int flags,
+               float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -1106,6 +1319,90 @@ float64 __attribute__((flatten)) float64_muladd(float64 a, float64 b, float64 c,
     return float64_round_pack_canonical(pr, status);
 }
 
+float32 __attribute__((flatten)) float32_muladd(float32 a, float32 b, float32 c,
+                                                int flags, float_status *s)
+{
+    union_float32 ua, ub, uc, ur;
+
+    if (!can_use_fpu(s) || (flags & float_muladd_halve_result)) {
+        goto soft;
+    }
+    float32_input_flush2(&a, &b, s);
+    if (unlikely(s->flush_inputs_to_zero)) {
+        c = float32_squash_input_denormal(c, s);
+    }
+    if (unlikely(!float32_is_zero_or_normal(a) ||
+                 !float32_is_zero_or_normal(b) ||
+                 !float32_is_zero_or_normal(c))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    uc.s = c;
+    if (flags & float_muladd_negate_product) {
+        ua.h = -ua.h;
+    }
+    if (flags & float_muladd_negate_c) {
+        uc.h = -uc.h;
+    }
+    ur.h = fmaf(ua.h, ub.h, uc.h);
+    if (unlikely(float32_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN)) {
+        goto soft;
+    }
+    if (flags & float_muladd_negate_result) {
+        return float32_chs(ur.s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f32_muladd(a, b, c, flags, s);
+}
+
+float64 __attribute__((flatten)) float64_muladd(float64 a, float64 b, float64 c,
+                                                int flags, float_status *s)
+{
+    union_float64 ua, ub, uc, ur;
+
+    if (!can_use_fpu(s) || (flags & float_muladd_halve_result)) {
+        goto soft;
+    }
+    float64_input_flush2(&a, &b, s);
+    if (unlikely(s->flush_inputs_to_zero)) {
+        c = float64_squash_input_denormal(c, s);
+    }
+    if (unlikely(!float64_is_zero_or_normal(a) ||
+                 !float64_is_zero_or_normal(b) ||
+                 !float64_is_zero_or_normal(c))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    uc.s = c;
+    if (flags & float_muladd_negate_product) {
+        ua.h = -ua.h;
+    }
+    if (flags & float_muladd_negate_c) {
+        uc.h = -uc.h;
+    }
+    ur.h = fma(ua.h, ub.h, uc.h);
+    if (unlikely(float64_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN)) {
+        goto soft;
+    }
+    if (flags & float_muladd_negate_result) {
+        return float64_chs(ur.s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f64_muladd(a, b, c, flags, s);
+}
+
 /*
  * Returns the result of dividing the floating-point value `a' by the
  * corresponding value `b'. The operation is performed according to
@@ -1119,17 +1416,23 @@ static FloatParts div_floats(FloatParts a, FloatParts b, float_status *s)
     if (a.cls == float_class_normal && b.cls == float_class_normal) {
         uint64_t temp_lo, temp_hi;
         int exp = a.exp - b.exp;
+
+        /* The quotient must have its msb at DECOMPOSED_BINARY_POINT, so that
+         * no precision is lost; if a.frac < b.frac, shift the dividend one
+         * more bit and adjust the exponent.  div128To64 needs a divisor with
+         * the msb set, so both operands are shifted left by one more bit.
+         * That doubles the remainder, which does not change whether it is
+         * zero.
+         */
+        shortShift128Left(0, a.frac, DECOMPOSED_BINARY_POINT + 1,
+                          &temp_hi, &temp_lo);
         if (a.frac < b.frac) {
             exp -= 1;
-            shortShift128Left(0, a.frac, DECOMPOSED_BINARY_POINT + 1,
-                              &temp_hi, &temp_lo);
-        } else {
-            shortShift128Left(0, a.frac, DECOMPOSED_BINARY_POINT,
-                              &temp_hi, &temp_lo);
+            shortShift128Left(temp_hi, temp_lo, 1, &temp_hi, &temp_lo);
         }
         /* LSB of quot is set if inexact which roundandpack will use
          * to set flags. Yet again we re-use a for the result */
-        a.frac = div128To64(temp_lo, temp_hi, b.frac);
+        a.frac = div128To64(temp_lo, temp_hi, b.frac << 1);
         a.sign = sign;
         a.exp = exp;
         return a;
@@ -1176,7 +1479,8 @@ float16 float16_div(float16 a, float16 b, float_status *status)
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_div(float32 a, float32 b, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pb = float32_unpack_canonical(b, status);
@@ -1185,7 +1489,8 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_div(float64 a, float64 b, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pb = float64_unpack_canonical(b, status);
@@ -1194,6 +1499,60 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     return float64_round_pack_canonical(pr, status);
 }
 
+float32 float32_div(float32 a, float32 b, float_status *s)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    float32_input_flush2(&a, &b, s);
+    /* Division by zero raises a flag: leave it to softfloat */
+    if (unlikely(!float32_is_zero_or_normal(a) || !float32_is_normal(b))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h / ub.h;
+    if (unlikely(float32_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && !float32_is_zero(a)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft_f32_div(a, b, s);
+}
+
+float64 float64_div(float64 a, float64 b, float_status *s)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    float64_input_flush2(&a, &b, s);
+    /* Division by zero raises a flag: leave it to softfloat */
+    if (unlikely(!float64_is_zero_or_normal(a) || !float64_is_normal(b))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ub.s = b;
+    ur.h = ua.h / ub.h;
+    if (unlikely(float64_is_infinity(ur.s))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) && !float64_is_zero(a)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft_f64_div(a, b, s);
+}
+
 /*
  * Rounds the floating-point value `a' to an integer, and returns the
  * result as a floating-point value. The operation is performed
@@ -1981,20 +2340,68 @@ float16 __attribute__((flatten)) float16_sqrt(float16 a, float_status *status)
     return float16_round_pack_canonical(pr, status);
 }
 
-float32 __attribute__((flatten)) float32_sqrt(float32 a, float_status *status)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_sqrt(float32 a, float_status *status)
 {
     FloatParts pa = float32_unpack_canonical(a, status);
     FloatParts pr = sqrt_float(pa, status, &float32_params);
     return float32_round_pack_canonical(pr, status);
 }
 
-float64 __attribute__((flatten)) float64_sqrt(float64 a, float_status *status)
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_sqrt(float64 a, float_status *status)
 {
     FloatParts pa = float64_unpack_canonical(a, status);
     FloatParts pr = sqrt_float(pa, status, &float64_params);
     return float64_round_pack_canonical(pr, status);
 }
 
+float32 __attribute__((flatten)) float32_sqrt(float32 a, float_status *s)
+{
+    union_float32 ua, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    if (unlikely(s->flush_inputs_to_zero)) {
+        a = float32_squash_input_denormal(a, s);
+    }
+    /* The square root of a normal number is normal */
+    if (unlikely(!float32_is_zero_or_normal(a) || float32_is_neg(a))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ur.h = sqrtf(ua.h);
+    return ur.s;
+
+ soft:
+    return soft_f32_sqrt(a, s);
+}
+
+float64 __attribute__((flatten)) float64_sqrt(float64 a, float_status *s)
+{
+    union_float64 ua, ur;
+
+    if (!can_use_fpu(s)) {
+        goto soft;
+    }
+    if (unlikely(s->flush_inputs_to_zero)) {
+        a = float64_squash_input_denormal(a, s);
+    }
+    /* The square root of a normal number is normal */
+    if (unlikely(!float64_is_zero_or_normal(a) || float64_is_neg(a))) {
+        goto soft;
+    }
+
+    ua.s = a;
+    ur.h = sqrt(ua.h);
+    return ur.s;
+
+ soft:
+    return soft_f64_sqrt(a, s);
+}
+
 
 /*----------------------------------------------------------------------------
 | Takes a 64-bit fixed-point value `absZ' with binary point between bits 6
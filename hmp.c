@@ -265,10 +265,36 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        CompressThreadStatsList *thread;
+
+        monitor_printf(mon, "compression method: %s\n",
+                       CompressMethod_str(info->compression->method));
+        monitor_printf(mon, "compressed pages: %" PRIu64 "\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+        for (thread = info->compression->threads; thread;
+             thread = thread->next) {
+            monitor_printf(mon, "compress thread %" PRId64 ": %" PRIu64
+                           " pages, %" PRIu64 " kbytes, busy %" PRIu64
+                           " ms\n",
+                           thread->value->id, thread->value->pages,
+                           thread->value->compressed_size >> 10,
+                           thread->value->busy_time / 1000);
+        }
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -355,6 +381,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
+        assert(params->has_compress_method);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_METHOD),
+            CompressMethod_str(params->compress_method));
     }
 
     qapi_free_MigrationParameters(params);
@@ -1642,6 +1672,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         }
         p->xbzrle_cache_size = cache_size;
         break;
+    case MIGRATION_PARAMETER_COMPRESS_METHOD:
+        p->has_compress_method = true;
+        p->compress_method = qapi_enum_parse(&CompressMethod_lookup, valuestr,
+                                             -1, &err);
+        break;
     default:
         assert(0);
     }
@@ -26,14 +26,23 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* Virtqueues are distributed round-robin over the IOThreads of the device.
+ * Each IOThread batches guest notifications for its own virtqueues.
+ */
+typedef struct VirtIOBlockDataPlaneThread {
+    VirtIOBlockDataPlane *s;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned long *batch_notify_vqs;
+} VirtIOBlockDataPlaneThread;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
     bool batch_notifications;
 
     /* Note that these EventNotifiers are assigned by value.  This is
@@ -41,16 +50,38 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    VirtIOBlockDataPlaneThread *threads;
+    unsigned num_threads;
+
+    /* Number of threads that process virtqueues.  This is 1 instead of
+     * num_threads while the BlockBackend cannot be used from several
+     * AioContexts, see blk_supports_multiqueue().
+     */
+    unsigned active_threads;
 };
 
+static VirtIOBlockDataPlaneThread *
+virtio_blk_data_plane_vq_thread(VirtIOBlockDataPlane *s, unsigned vq_idx)
+{
+    return &s->threads[vq_idx % s->active_threads];
+}
+
+/* The AioContext that processes @vq.  Its lock protects the virtqueue. */
+AioContext *virtio_blk_data_plane_get_vq_aio_context(VirtIOBlockDataPlane *s,
+                                                     VirtQueue *vq)
+{
+    return virtio_blk_data_plane_vq_thread(s, virtio_get_queue_index(vq))->ctx;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
     if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-        qemu_bh_schedule(s->bh);
+        unsigned i = virtio_get_queue_index(vq);
+        VirtIOBlockDataPlaneThread *t = virtio_blk_data_plane_vq_thread(s, i);
+
+        atomic_or(&t->batch_notify_vqs[BIT_WORD(i)], BIT_MASK(i));
+        qemu_bh_schedule(t->bh);
     } else {
         virtio_notify_irqfd(s->vdev, vq);
     }
@@ -58,16 +89,13 @@ void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = atomic_xchg(&t->batch_notify_vqs[BIT_WORD(j)], 0);
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -80,6 +108,38 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Look up the IOThreads of the colon-separated iothread-vq-mapping list */
+static IOThread **virtio_blk_parse_iothread_vq_mapping(const char *mapping,
+                                                       unsigned *count,
+                                                       Error **errp)
+{
+    gchar **ids = g_strsplit(mapping, ":", -1);
+    IOThread **iothreads;
+    unsigned i, n = g_strv_length(ids);
+
+    if (n == 0) {
+        error_setg(errp, "iothread-vq-mapping must list at least one iothread");
+        g_strfreev(ids);
+        return NULL;
+    }
+
+    iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        iothreads[i] = iothread_by_id(ids[i]);
+        if (!iothreads[i]) {
+            error_setg(errp, "iothread-vq-mapping: iothread '%s' not found",
+                       ids[i]);
+            g_free(iothreads);
+            g_strfreev(ids);
+            return NULL;
+        }
+    }
+
+    g_strfreev(ids);
+    *count = n;
+    return iothreads;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -88,10 +148,19 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    unsigned num_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties "
+                   "are mutually exclusive");
+        return false;
+    }
+
+    if (conf->iothread || conf->iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -116,19 +185,42 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return false;
     }
 
+    if (conf->iothread_vq_mapping) {
+        iothreads = virtio_blk_parse_iothread_vq_mapping(
+                conf->iothread_vq_mapping, &num_iothreads, errp);
+        if (!iothreads) {
+            return false;
+        }
+        /* Extra IOThreads would not get any virtqueue */
+        num_iothreads = MIN(num_iothreads, conf->num_queues);
+    } else if (conf->iothread) {
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = conf->iothread;
+        num_iothreads = 1;
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
-
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
-    } else {
-        s->ctx = qemu_get_aio_context();
+    s->num_threads = MAX(num_iothreads, 1);
+    s->active_threads = 1;
+    s->threads = g_new0(VirtIOBlockDataPlaneThread, s->num_threads);
+
+    for (i = 0; i < s->num_threads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        t->s = s;
+        if (iothreads) {
+            t->iothread = iothreads[i];
+            object_ref(OBJECT(t->iothread));
+            t->ctx = iothread_get_aio_context(t->iothread);
+        } else {
+            t->ctx = qemu_get_aio_context();
+        }
+        t->bh = aio_bh_new(t->ctx, notify_guest_bh, t);
+        t->batch_notify_vqs = bitmap_new(conf->num_queues);
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    g_free(iothreads);
 
     *dataplane = s;
 
@@ -139,6 +231,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -146,11 +239,16 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_threads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        g_free(t->batch_notify_vqs);
+        qemu_bh_delete(t->bh);
+        if (t->iothread) {
+            object_unref(OBJECT(t->iothread));
+        }
     }
+    g_free(s->threads);
     g_free(s);
 }
 
@@ -182,6 +280,20 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
+    /* Format drivers, filters and most protocol drivers assume that all
+     * requests come from the AioContext of the node.  Fall back to the first
+     * IOThread for all virtqueues if that is the case for this drive.
+     */
+    s->active_threads = 1;
+    if (s->num_threads > 1) {
+        if (blk_supports_multiqueue(s->conf->conf.blk)) {
+            s->active_threads = s->num_threads;
+        } else {
+            warn_report("virtio-blk: drive does not support "
+                        "iothread-vq-mapping, using only the first iothread");
+        }
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         s->batch_notifications = true;
     } else {
@@ -213,7 +325,12 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     vblk->dataplane_started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    blk_set_aio_context(s->conf->conf.blk, s->ctx);
+    /* The BlockBackend lives in the AioContext of the first IOThread.  With
+     * more IOThreads, every virtqueue submits requests from its own
+     * AioContext and they complete there as well.
+     */
+    blk_set_aio_context(s->conf->conf.blk, s->threads[0].ctx);
+    blk_set_multiqueue(s->conf->conf.blk, s->active_threads > 1);
 
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
@@ -223,14 +340,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_vq_thread(s, i)->ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -246,13 +364,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned i;
 
-    for (i = 0; i < s->conf->num_queues; i++) {
+    for (i = t - s->threads; i < s->conf->num_queues; i += s->active_threads) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(vq, t->ctx, NULL);
     }
 }
 
@@ -279,13 +398,19 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+    for (i = 0; i < s->active_threads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        aio_context_acquire(t->ctx);
+        aio_wait_bh_oneshot(t->ctx, virtio_blk_data_plane_stop_bh, t);
+        aio_context_release(t->ctx);
+    }
 
     /* Drain and switch bs back to the QEMU main loop */
+    aio_context_acquire(s->threads[0].ctx);
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
-
-    aio_context_release(s->ctx);
+    aio_context_release(s->threads[0].ctx);
+    blk_set_multiqueue(s->conf->conf.blk, false);
 
     for (i = 0; i < nvqs; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
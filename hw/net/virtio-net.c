@@ -16,9 +16,13 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
+#include "net_rx_pkt.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "block/aio-wait.h"
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
@@ -41,6 +45,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* TX descriptors popped from the ring, and completed, at a time */
+#define VIRTIO_NET_TX_BATCH 32
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -64,6 +71,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -94,6 +103,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -119,6 +133,33 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && vdev->vm_running;
 }
 
+/* With an iothread, the data queues and their peers run in n->ctx without
+ * the BQL.  Everything that touches queue state takes the AioContext lock,
+ * which is recursive, so nested callbacks are fine.
+ */
+static void virtio_net_lock(VirtIONet *n)
+{
+    if (n->ctx) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static void virtio_net_unlock(VirtIONet *n)
+{
+    if (n->ctx) {
+        aio_context_release(n->ctx);
+    }
+}
+
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(n), vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
 static void virtio_net_announce_timer(void *opaque)
 {
     VirtIONet *n = opaque;
@@ -244,10 +285,14 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
+static bool virtio_net_rsc_flush(VirtIONetQueue *q);
+static void virtio_net_rsc_purge(VirtIONetQueue *q);
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -257,7 +302,9 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
+    virtio_net_lock(n);
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -273,6 +320,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
+        } else {
+            virtio_net_rsc_purge(q);
         }
 
         if (!q->tx_waiting) {
@@ -303,6 +352,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_unlock(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -424,6 +474,208 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+/* Receive-side scaling
+ *
+ * The guest programs a Toeplitz key and an indirection table; received
+ * packets are hashed and steered to the rx queue the table selects, no
+ * matter which backend queue they arrived on.  With VIRTIO_NET_F_HASH_REPORT
+ * the hash is also reported in the vnet header.
+ */
+
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    n->rss_data.enabled = false;
+    n->rss_data.redirect = false;
+    n->rss_data.populate_hash = false;
+}
+
+/* Returns the VIRTIO_NET_HASH_REPORT_* type of the hash stored in @hash */
+static uint16_t virtio_net_rss_hash(VirtIONet *n, const uint8_t *buf,
+                                    size_t size, uint32_t *hash)
+{
+    uint32_t types = n->rss_data.hash_types;
+    bool isip4, isip6, isudp, istcp;
+    NetRxPktRssType type;
+    uint16_t report;
+
+    net_rx_pkt_set_protocols(n->rx_pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    net_rx_pkt_get_protocols(n->rx_pkt, &isip4, &isip6, &isudp, &istcp);
+
+    if (isip4 && istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+        type = NetPktRssIpV4Tcp;
+        report = VIRTIO_NET_HASH_REPORT_TCPv4;
+    } else if (isip4 && isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+        type = NetPktRssIpV4Udp;
+        report = VIRTIO_NET_HASH_REPORT_UDPv4;
+    } else if (isip4 && (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4)) {
+        type = NetPktRssIpV4;
+        report = VIRTIO_NET_HASH_REPORT_IPv4;
+    } else if (isip6 && istcp && (types & (VIRTIO_NET_RSS_HASH_TYPE_TCPv6 |
+                                           VIRTIO_NET_RSS_HASH_TYPE_TCP_EX))) {
+        type = NetPktRssIpV6Tcp;
+        report = (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX) ?
+                 VIRTIO_NET_HASH_REPORT_TCPv6_EX : VIRTIO_NET_HASH_REPORT_TCPv6;
+    } else if (isip6 && isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+        type = NetPktRssIpV6UdpEx;
+        report = VIRTIO_NET_HASH_REPORT_UDPv6_EX;
+    } else if (isip6 && isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+        type = NetPktRssIpV6Udp;
+        report = VIRTIO_NET_HASH_REPORT_UDPv6;
+    } else if (isip6 && (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX)) {
+        type = NetPktRssIpV6Ex;
+        report = VIRTIO_NET_HASH_REPORT_IPv6_EX;
+    } else if (isip6 && (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6)) {
+        type = NetPktRssIpV6;
+        report = VIRTIO_NET_HASH_REPORT_IPv6;
+    } else {
+        *hash = 0;
+        return VIRTIO_NET_HASH_REPORT_NONE;
+    }
+
+    *hash = net_rx_pkt_calc_rss_hash(n->rx_pkt, type, n->rss_data.key);
+    return report;
+}
+
+/* Pick the rx queue for a packet according to the indirection table.  The
+ * hash is kept for virtio_net_rss_report() until n->rss_data.pkt_buf is
+ * cleared. */
+static int virtio_net_rss_queue(VirtIONet *n, const uint8_t *buf, size_t size)
+{
+    VirtioNetRssData *rss = &n->rss_data;
+
+    rss->pkt_hash_report = virtio_net_rss_hash(n, buf, size, &rss->pkt_hash);
+    rss->pkt_buf = buf;
+    if (rss->pkt_hash_report == VIRTIO_NET_HASH_REPORT_NONE) {
+        return rss->default_queue;
+    }
+    return rss->indirections_table[rss->pkt_hash &
+                                   (rss->indirections_len - 1)];
+}
+
+/* Fill in the hash fields of a virtio_net_hdr_v1_hash header */
+static void virtio_net_rss_report(VirtIONet *n, const struct iovec *iov,
+                                  int iov_cnt, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_hdr_v1_hash hdr = {};
+    uint16_t report = VIRTIO_NET_HASH_REPORT_NONE;
+    uint32_t hash = 0;
+
+    if (n->rss_data.populate_hash && buf == n->rss_data.pkt_buf) {
+        /* already hashed by virtio_net_rss_queue() */
+        hash = n->rss_data.pkt_hash;
+        report = n->rss_data.pkt_hash_report;
+    } else if (n->rss_data.populate_hash) {
+        report = virtio_net_rss_hash(n, buf, size, &hash);
+    }
+    virtio_stl_p(vdev, &hdr.hash_value, hash);
+    virtio_stw_p(vdev, &hdr.hash_report, report);
+    iov_from_buf(iov, iov_cnt, offsetof(struct virtio_net_hdr_v1_hash,
+                                        hash_value),
+                 &hdr.hash_value,
+                 sizeof(hdr) - offsetof(struct virtio_net_hdr_v1_hash,
+                                        hash_value));
+}
+
+/* Parse VIRTIO_NET_CTRL_MQ_RSS_CONFIG, or VIRTIO_NET_CTRL_MQ_HASH_CONFIG
+ * whose layout matches it with the table and queue fields reserved.
+ * Returns the number of queue pairs to use, or 0 if the command is invalid.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_rss_config cfg;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    size_t len, offset = 0;
+    uint16_t queues, i;
+
+    if (!virtio_vdev_has_feature(vdev, do_rss ? VIRTIO_NET_F_RSS
+                                              : VIRTIO_NET_F_HASH_REPORT)) {
+        goto error;
+    }
+
+    len = offsetof(struct virtio_net_rss_config, indirection_table);
+    if (iov_to_buf(iov, iov_cnt, offset, &cfg, len) != len) {
+        goto error;
+    }
+    offset += len;
+
+    n->rss_data.hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    if (n->rss_data.hash_types & ~VIRTIO_NET_RSS_SUPPORTED_HASHES) {
+        goto error;
+    }
+    if (do_rss) {
+        n->rss_data.indirections_len =
+            virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        n->rss_data.default_queue =
+            virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    } else {
+        n->rss_data.indirections_len = 1;
+        n->rss_data.default_queue = 0;
+    }
+    if (!is_power_of_2(n->rss_data.indirections_len) ||
+        n->rss_data.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        n->rss_data.default_queue >= n->max_queues) {
+        goto error;
+    }
+
+    len = sizeof(uint16_t) * n->rss_data.indirections_len;
+    if (iov_to_buf(iov, iov_cnt, offset, n->rss_data.indirections_table,
+                   len) != len) {
+        goto error;
+    }
+    offset += len;
+    for (i = 0; i < n->rss_data.indirections_len; i++) {
+        uint16_t *entry = &n->rss_data.indirections_table[i];
+
+        *entry = do_rss ? virtio_lduw_p(vdev, entry) : 0;
+        if (*entry >= n->max_queues) {
+            goto error;
+        }
+    }
+
+    if (iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail)) !=
+        sizeof(tail)) {
+        goto error;
+    }
+    offset += sizeof(tail);
+
+    queues = do_rss ? virtio_lduw_p(vdev, &tail.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues ||
+        tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE ||
+        (!tail.hash_key_length && n->rss_data.hash_types)) {
+        goto error;
+    }
+
+    if (!n->rss_data.hash_types) {
+        /* The guest is turning the feature off */
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+
+    memset(n->rss_data.key, 0, sizeof(n->rss_data.key));
+    if (iov_to_buf(iov, iov_cnt, offset, n->rss_data.key,
+                   tail.hash_key_length) != tail.hash_key_length) {
+        goto error;
+    }
+
+    n->rss_data.enabled = true;
+    n->rss_data.redirect = do_rss;
+    n->rss_data.populate_hash =
+        virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT);
+    return queues;
+
+error:
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -437,6 +689,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+    virtio_net_disable_rss(n);
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -477,15 +730,25 @@ static int peer_has_ufo(VirtIONet *n)
     return n->has_ufo;
 }
 
+/* With rsc=on, coalesced frames carry their own vnet header even if the
+ * peer does not supply one.
+ */
+static bool virtio_net_has_guest_offloads(VirtIONet *n)
+{
+    return peer_has_vnet_hdr(n) || n->net_conf.rsc;
+}
+
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
-    if (version_1) {
+    if (hash_report) {
+        n->guest_hdr_len = sizeof(struct virtio_net_hdr_v1_hash);
+    } else if (version_1) {
         n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
@@ -597,16 +860,25 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
 
     virtio_add_feature(&features, VIRTIO_NET_F_MAC);
 
+    /* RSS and hash reporting are configured through the control queue */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!peer_has_vnet_hdr(n)) {
         virtio_clear_feature(&features, VIRTIO_NET_F_CSUM);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO4);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
+        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
+    }
+
+    if (!virtio_net_has_guest_offloads(n)) {
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
     }
 
     if (!peer_has_vnet_hdr(n) || !peer_has_ufo(n)) {
@@ -617,6 +889,10 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* Steering and hashing happen in QEMU's receive path */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -682,15 +958,18 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     }
 
     virtio_net_set_multiqueue(n,
+                              virtio_has_feature(features, VIRTIO_NET_F_RSS) ||
                               virtio_has_feature(features, VIRTIO_NET_F_MQ));
 
     virtio_net_set_mrg_rx_bufs(n,
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
-    if (n->has_vnet_hdr) {
+    if (virtio_net_has_guest_offloads(n)) {
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
@@ -751,6 +1030,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     uint64_t offloads;
     size_t s;
+    int i;
 
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
         return VIRTIO_NET_ERR;
@@ -766,7 +1046,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
 
         offloads = virtio_ldq_p(vdev, &offloads);
 
-        if (!n->has_vnet_hdr) {
+        if (!virtio_net_has_guest_offloads(n)) {
             return VIRTIO_NET_ERR;
         }
 
@@ -775,6 +1055,15 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
             return VIRTIO_NET_ERR;
         }
 
+        /* Pending flows were coalesced for the old offloads */
+        rcu_read_lock();
+        for (i = 0; i < n->max_queues; i++) {
+            if (!virtio_net_rsc_flush(&n->vqs[i])) {
+                virtio_net_rsc_purge(&n->vqs[i]);
+            }
+        }
+        rcu_read_unlock();
+
         n->curr_guest_offloads = offloads;
         virtio_net_apply_guest_offloads(n);
 
@@ -934,17 +1223,29 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
-    }
-
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_MQ_HASH_CONFIG:
+        /* Hash reporting alone leaves the queues as they are */
+        return virtio_net_handle_rss(n, iov, iov_cnt, false) ?
+               VIRTIO_NET_OK : VIRTIO_NET_ERR;
+    case VIRTIO_NET_CTRL_MQ_RSS_CONFIG:
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+        if (!queues) {
+            return VIRTIO_NET_ERR;
+        }
+        break;
+    case VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET:
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        virtio_net_disable_rss(n);
+        break;
+    default:
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
@@ -971,6 +1272,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    virtio_net_lock(n);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1012,6 +1314,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    virtio_net_unlock(n);
 }
 
 /* RX */
@@ -1021,6 +1324,21 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
+    int i;
+
+    /* Coalesced flows were received before anything still queued */
+    rcu_read_lock();
+    virtio_net_rsc_flush(&n->vqs[queue_index]);
+    rcu_read_unlock();
+
+    if (n->rss_data.redirect) {
+        /* Packets steered to this queue wait on their backend queue */
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        return;
+    }
+
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -1105,9 +1423,13 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                           const struct virtio_net_hdr *hdr,
                            const void *buf, size_t size)
 {
-    if (n->has_vnet_hdr) {
+    if (hdr) {
+        /* Built by QEMU, already in guest byte order */
+        iov_from_buf(iov, iov_cnt, 0, hdr, sizeof(*hdr));
+    } else if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
@@ -1177,8 +1499,43 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+/* Copy @bytes of @src from @src_off on into @dst at @dst_off */
+static size_t virtio_net_iov_copy(const struct iovec *dst, unsigned dst_cnt,
+                                  size_t dst_off,
+                                  const struct iovec *src, unsigned src_cnt,
+                                  size_t src_off, size_t bytes)
+{
+    size_t done = 0;
+    unsigned i;
+
+    for (i = 0; i < src_cnt && done < bytes; i++) {
+        size_t len, copied;
+
+        if (src_off >= src[i].iov_len) {
+            src_off -= src[i].iov_len;
+            continue;
+        }
+        len = MIN(src[i].iov_len - src_off, bytes - done);
+        copied = iov_from_buf(dst, dst_cnt, dst_off + done,
+                              src[i].iov_base + src_off, len);
+        done += copied;
+        if (copied < len) {
+            break;
+        }
+        src_off = 0;
+    }
+    return done;
+}
+
+/* @hdr, if not NULL, is given to the guest instead of the vnet header that
+ * the peer supplied with the frame, or instead of an empty one if it supplies
+ * none.  The filters look at the start of the frame in @iov[0], which must
+ * hold the Ethernet header and VLAN tag.  If the peer supplies a vnet header,
+ * or the guest wants hash reports, the whole frame must be in @iov[0].
+ */
+static ssize_t virtio_net_receive_iov_rcu(NetClientState *nc,
+                                          const struct virtio_net_hdr *hdr,
+                                          const struct iovec *iov, int iov_cnt)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1187,6 +1544,8 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
+    const uint8_t *buf = iov[0].iov_base;
+    size_t size = iov_size(iov, iov_cnt);
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
@@ -1241,7 +1600,10 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, hdr, buf, size);
+            if (n->guest_hdr_len == sizeof(struct virtio_net_hdr_v1_hash)) {
+                virtio_net_rss_report(n, sg, elem->in_num, buf, size);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1250,8 +1612,8 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem->in_num, guest_offset,
-                           buf + offset, size - offset);
+        len = virtio_net_iov_copy(sg, elem->in_num, guest_offset,
+                                  iov, iov_cnt, offset, size - offset);
         total += len;
         offset += len;
         /* If buffers can't be merged, at this point we
@@ -1276,48 +1638,634 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
+
+    return size;
+}
+
+static ssize_t virtio_net_receive_rcu(NetClientState *nc,
+                                      const struct virtio_net_hdr *hdr,
+                                      const uint8_t *buf, size_t size)
+{
+    const struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return virtio_net_receive_iov_rcu(nc, hdr, &iov, 1);
+}
+
+/* Receive segment coalescing
+ *
+ * With rsc=on, in-order TCP segments of a flow are merged into a single
+ * large packet that the guest receives with the GSO fields of its vnet
+ * header set, like GRO does in the host kernel.  This needs a guest that
+ * accepts TSO for the address family.  The vnet header of a coalesced
+ * packet is built here, so peers without vnet headers (slirp, socket) work
+ * too; their segments have their checksums verified before merging, and
+ * the guest is offered GUEST_CSUM and TSO for them only when rsc=on.
+ * A flow is delivered when a segment cannot be appended, when the peer's
+ * batch ends, or after rsc_interval nanoseconds.
+ */
+
+#define RSC_MAX_FLOWS   8
+#define RSC_MAX_IP_LEN  0xffff
+
+#define RSC_BYPASS      0   /* not TCP, deliver as is */
+#define RSC_FINAL       1   /* TCP, but must be delivered on its own */
+#define RSC_CANDIDATE   2   /* TCP data segment that may be coalesced */
+
+typedef struct VirtIONetRscFlow {
+    uint8_t *buf;           /* host vnet header, if any, and the frame */
+    size_t size;            /* bytes used in buf, 0 if the slot is free */
+    struct virtio_net_hdr hdr;  /* guest header for the coalesced frame */
+    size_t l4_off;
+    size_t data_off;
+    bool ipv6;
+    uint32_t next_seq;
+    uint16_t mss;
+    uint16_t segs;
+} VirtIONetRscFlow;
+
+typedef struct VirtIONetRscPkt {
+    bool ipv6;
+    size_t l3_off;
+    size_t l4_off;
+    size_t data_off;
+    size_t end;             /* end of the IP packet, without padding */
+    uint32_t seq;
+    uint8_t flags;
+} VirtIONetRscPkt;
+
+static bool virtio_net_rsc_active(VirtIONet *n)
+{
+    return n->net_conf.rsc && n->has_vnet_hdr &&
+           (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM));
+}
+
+static bool virtio_net_rsc_csum_ok(const uint8_t *buf,
+                                   const VirtIONetRscPkt *pkt)
+{
+    uint8_t *l3 = (uint8_t *)buf + pkt->l3_off;
+    uint8_t *l4 = (uint8_t *)buf + pkt->l4_off;
+    size_t l4_len = pkt->end - pkt->l4_off;
+    uint32_t sum;
+
+    if (pkt->ipv6) {
+        sum = net_checksum_add(32, l3 + 8);
+    } else {
+        if (net_raw_checksum(l3, pkt->l4_off - pkt->l3_off)) {
+            return false;
+        }
+        sum = net_checksum_add(8, l3 + 12);
+    }
+    sum += IP_PROTO_TCP + l4_len;
+    sum += net_checksum_add(l4_len, l4);
+
+    return net_checksum_finish(sum) == 0;
+}
+
+static int virtio_net_rsc_parse(VirtIONet *n, const uint8_t *buf, size_t size,
+                                VirtIONetRscPkt *pkt)
+{
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+    const uint8_t *l3, *l4;
+    size_t l3_len;
+
+    pkt->l3_off = n->host_hdr_len + ETH_HLEN;
+    if (size < pkt->l3_off + sizeof(struct ip6_header)) {
+        return RSC_BYPASS;
+    }
+
+    l3 = buf + pkt->l3_off;
+    switch (lduw_be_p(buf + n->host_hdr_len + 12)) {
+    case ETH_P_IP:
+        /* No options and no fragments */
+        if (l3[0] != 0x45 || l3[9] != IP_PROTO_TCP ||
+            (lduw_be_p(l3 + 6) & (IP_MF | IP_OFFMASK))) {
+            return RSC_BYPASS;
+        }
+        l3_len = lduw_be_p(l3 + 2);
+        pkt->ipv6 = false;
+        pkt->l4_off = pkt->l3_off + sizeof(struct ip_header);
+        break;
+    case ETH_P_IPV6:
+        /* No extension headers */
+        if ((l3[0] >> 4) != 6 || l3[6] != IP_PROTO_TCP) {
+            return RSC_BYPASS;
+        }
+        l3_len = sizeof(struct ip6_header) + lduw_be_p(l3 + 4);
+        pkt->ipv6 = true;
+        pkt->l4_off = pkt->l3_off + sizeof(struct ip6_header);
+        break;
+    default:
+        return RSC_BYPASS;
+    }
+
+    pkt->end = pkt->l3_off + l3_len;
+    if (pkt->end > size || pkt->end < pkt->l4_off + sizeof(struct tcp_header)) {
+        return RSC_BYPASS;
+    }
+
+    l4 = buf + pkt->l4_off;
+    pkt->data_off = pkt->l4_off + (l4[12] >> 4) * 4;
+    if (pkt->data_off < pkt->l4_off + sizeof(struct tcp_header) ||
+        pkt->data_off > pkt->end) {
+        return RSC_BYPASS;
+    }
+    pkt->seq = ldl_be_p(l4 + 4);
+    pkt->flags = l4[13];
+
+    /* Whatever happens now, the segment must not overtake its flow */
+    if ((n->host_hdr_len &&
+         (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+          (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))) ||
+        (pkt->flags & ~(TH_ACK | TH_PUSH)) != TH_ACK ||
+        pkt->data_off == pkt->end) {
+        return RSC_FINAL;
+    }
+    if (!(n->curr_guest_offloads &
+          (1ULL << (pkt->ipv6 ? VIRTIO_NET_F_GUEST_TSO6
+                              : VIRTIO_NET_F_GUEST_TSO4)))) {
+        return RSC_FINAL;
+    }
+    if (!(n->host_hdr_len && (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)) &&
+        !virtio_net_rsc_csum_ok(buf, pkt)) {
+        return RSC_FINAL;
+    }
+
+    return RSC_CANDIDATE;
+}
+
+static bool virtio_net_rsc_same_flow(const VirtIONetRscFlow *flow,
+                                     const uint8_t *buf,
+                                     const VirtIONetRscPkt *pkt)
+{
+    const uint8_t *fl3 = flow->buf + pkt->l3_off;
+    const uint8_t *l3 = buf + pkt->l3_off;
+
+    if (flow->ipv6 != pkt->ipv6) {
+        return false;
+    }
+    /* Addresses, then ports */
+    if (pkt->ipv6 ? memcmp(fl3 + 8, l3 + 8, 32) : memcmp(fl3 + 12, l3 + 12, 8)) {
+        return false;
+    }
+    return !memcmp(flow->buf + flow->l4_off, buf + pkt->l4_off, 4);
+}
+
+static bool virtio_net_rsc_can_merge(const VirtIONetRscFlow *flow,
+                                     const uint8_t *buf,
+                                     const VirtIONetRscPkt *pkt)
+{
+    const uint8_t *fl3 = flow->buf + pkt->l3_off;
+    const uint8_t *l3 = buf + pkt->l3_off;
+    const uint8_t *fl4 = flow->buf + flow->l4_off;
+    const uint8_t *l4 = buf + pkt->l4_off;
+    size_t len = pkt->end - pkt->data_off;
+    size_t tcp_hdr_len = pkt->data_off - pkt->l4_off;
+
+    if (pkt->seq != flow->next_seq || len > flow->mss ||
+        flow->size - pkt->l3_off + len > RSC_MAX_IP_LEN) {
+        return false;
+    }
+
+    /* The guest replicates the IP header to every segment it reassembles */
+    if (pkt->ipv6) {
+        if (memcmp(fl3, l3, 4) || fl3[7] != l3[7]) {
+            return false;
+        }
+    } else if (fl3[1] != l3[1] || fl3[8] != l3[8]) {
+        return false;
+    }
+
+    /* Same acknowledgement and identical TCP options */
+    return tcp_hdr_len == flow->data_off - flow->l4_off &&
+           !memcmp(fl4 + 8, l4 + 8, 4) &&
+           !memcmp(fl4 + sizeof(struct tcp_header),
+                   l4 + sizeof(struct tcp_header),
+                   tcp_hdr_len - sizeof(struct tcp_header));
+}
+
+static void virtio_net_rsc_start(VirtIONet *n, VirtIONetQueue *q,
+                                 VirtIONetRscFlow *flow, const uint8_t *buf,
+                                 const VirtIONetRscPkt *pkt)
+{
+    if (!flow->buf) {
+        flow->buf = g_malloc(pkt->l3_off + RSC_MAX_IP_LEN);
+    }
+    memcpy(flow->buf, buf, pkt->end);
+    flow->size = pkt->end;
+    flow->l4_off = pkt->l4_off;
+    flow->data_off = pkt->data_off;
+    flow->ipv6 = pkt->ipv6;
+    flow->mss = pkt->end - pkt->data_off;
+    flow->next_seq = pkt->seq + flow->mss;
+    flow->segs = 1;
+
+    if (!timer_pending(q->rsc_timer)) {
+        timer_mod(q->rsc_timer, qemu_clock_get_ns(QEMU_CLOCK_HOST) +
+                                n->net_conf.rsc_interval);
+    }
+}
+
+static void virtio_net_rsc_append(VirtIONetRscFlow *flow, const uint8_t *buf,
+                                  const VirtIONetRscPkt *pkt)
+{
+    uint8_t *fl4 = flow->buf + flow->l4_off;
+    const uint8_t *l4 = buf + pkt->l4_off;
+    size_t len = pkt->end - pkt->data_off;
+
+    memcpy(flow->buf + flow->size, buf + pkt->data_off, len);
+    flow->size += len;
+    flow->next_seq += len;
+    flow->segs++;
+
+    /* Report the latest window, and PSH if any segment had it */
+    memcpy(fl4 + 14, l4 + 14, 2);
+    fl4[13] |= pkt->flags & TH_PUSH;
+}
+
+/* Turn the coalesced frame into a GSO packet for the guest.  This only
+ * rewrites fields from scratch, so it is safe to repeat when delivery has
+ * to be retried.
+ */
+static void virtio_net_rsc_finish(VirtIONet *n, VirtIONetRscFlow *flow)
+{
+    struct virtio_net_hdr *hdr = &flow->hdr;
+    size_t l3_off = n->host_hdr_len + ETH_HLEN;
+    uint8_t *l3 = flow->buf + l3_off;
+    size_t l3_len = flow->size - l3_off;
+
+    if (flow->ipv6) {
+        stw_be_p(l3 + 4, l3_len - sizeof(struct ip6_header));
+    } else {
+        stw_be_p(l3 + 2, l3_len);
+        stw_be_p(l3 + 10, 0);
+        stw_be_p(l3 + 10, net_raw_checksum(l3, sizeof(struct ip_header)));
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    hdr->gso_type = flow->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6
+                               : VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr->hdr_len = flow->data_off - n->host_hdr_len;
+    hdr->gso_size = flow->mss;
+    virtio_net_hdr_swap(VIRTIO_DEVICE(n), hdr);
+}
+
+/* Returns false if the guest has no room for the flow yet */
+static bool virtio_net_rsc_deliver(NetClientState *nc, VirtIONetRscFlow *flow)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    const struct virtio_net_hdr *hdr = NULL;
+
+    if (flow->segs > 1) {
+        virtio_net_rsc_finish(n, flow);
+        hdr = &flow->hdr;
+    }
+    if (virtio_net_receive_rcu(nc, hdr, flow->buf, flow->size) == 0) {
+        return false;
+    }
+    flow->size = 0;
+    return true;
+}
+
+static bool virtio_net_rsc_flush(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    bool done = true;
+    int i;
+
+    if (!q->rsc_flows) {
+        return true;
+    }
+
+    for (i = 0; i < RSC_MAX_FLOWS; i++) {
+        if (q->rsc_flows[i].size &&
+            !virtio_net_rsc_deliver(nc, &q->rsc_flows[i])) {
+            done = false;
+        }
+    }
+    if (done) {
+        timer_del(q->rsc_timer);
+    }
+    return done;
+}
+
+static void virtio_net_rsc_purge(VirtIONetQueue *q)
+{
+    int i;
+
+    if (!q->rsc_flows) {
+        return;
+    }
+
+    for (i = 0; i < RSC_MAX_FLOWS; i++) {
+        q->rsc_flows[i].size = 0;
+    }
+    timer_del(q->rsc_timer);
+}
+
+static void virtio_net_rsc_cleanup(VirtIONetQueue *q)
+{
+    int i;
+
+    if (q->rsc_flows) {
+        for (i = 0; i < RSC_MAX_FLOWS; i++) {
+            g_free(q->rsc_flows[i].buf);
+        }
+        g_free(q->rsc_flows);
+        q->rsc_flows = NULL;
+    }
+    if (q->rsc_timer) {
+        timer_del(q->rsc_timer);
+        timer_free(q->rsc_timer);
+        q->rsc_timer = NULL;
+    }
+}
+
+static void virtio_net_rsc_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_lock(q->n);
+    rcu_read_lock();
+    if (!virtio_net_rsc_flush(q)) {
+        /* Retry once the guest has refilled the queue */
+        timer_mod(q->rsc_timer, qemu_clock_get_ns(QEMU_CLOCK_HOST) +
+                                q->n->net_conf.rsc_interval);
+    }
+    rcu_read_unlock();
+    virtio_net_unlock(q->n);
+}
+
+static ssize_t virtio_net_rsc_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetRscFlow *flow = NULL, *slot = NULL;
+    VirtIONetRscPkt pkt;
+    size_t len;
+    int type, i;
+
+    type = virtio_net_rsc_parse(n, buf, size, &pkt);
+    if (type == RSC_BYPASS) {
+        return virtio_net_receive_rcu(nc, NULL, buf, size);
+    }
+
+    if (!q->rsc_flows) {
+        q->rsc_flows = g_new0(VirtIONetRscFlow, RSC_MAX_FLOWS);
+    }
+    for (i = 0; i < RSC_MAX_FLOWS; i++) {
+        VirtIONetRscFlow *f = &q->rsc_flows[i];
+
+        if (!f->size) {
+            slot = slot ?: f;
+        } else if (virtio_net_rsc_same_flow(f, buf, &pkt)) {
+            flow = f;
+            break;
+        }
+    }
+
+    if (flow && type == RSC_CANDIDATE &&
+        virtio_net_rsc_can_merge(flow, buf, &pkt)) {
+        len = pkt.end - pkt.data_off;
+        if (!virtio_net_has_buffers(q, flow->size + len +
+                                       n->guest_hdr_len - n->host_hdr_len)) {
+            return 0;
+        }
+        virtio_net_rsc_append(flow, buf, &pkt);
+        if (len < flow->mss || (pkt.flags & TH_PUSH)) {
+            /* On failure the timer or the next refill will retry */
+            virtio_net_rsc_deliver(nc, flow);
+        }
+        return size;
+    }
 
+    if (flow) {
+        /* Keep the flow's segments in order */
+        if (!virtio_net_rsc_deliver(nc, flow)) {
+            return 0;
+        }
+        slot = flow;
+    }
+
+    if (type == RSC_FINAL || !slot || (pkt.flags & TH_PUSH)) {
+        return virtio_net_receive_rcu(nc, NULL, buf, size);
+    }
+
+    virtio_net_rsc_start(n, q, slot, buf, &pkt);
     return size;
 }
 
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONet *n = qemu_get_nic_opaque(nc);
     ssize_t r;
+    int index;
 
+    virtio_net_lock(n);
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    if (n->rss_data.redirect) {
+        index = virtio_net_rss_queue(n, buf, size);
+        if (index < n->curr_queues) {
+            nc = qemu_get_subqueue(n->nic, index);
+        }
+    }
+    if (virtio_net_rsc_active(n)) {
+        r = virtio_net_rsc_receive(nc, buf, size);
+    } else {
+        r = virtio_net_receive_rcu(nc, NULL, buf, size);
+    }
+    n->rss_data.pkt_buf = NULL;
     rcu_read_unlock();
+    virtio_net_unlock(n);
+    return r;
+}
+
+/* Peers such as slirp hand over payload that is still in their own buffers.
+ * Copy it into the guest's buffers directly unless something needs the frame
+ * in one piece, in which case it is linearized first.
+ */
+static ssize_t virtio_net_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t *buf;
+    ssize_t r;
+
+    if (iovcnt == 1) {
+        return virtio_net_receive(nc, iov[0].iov_base, iov[0].iov_len);
+    }
+
+    virtio_net_lock(n);
+    if (iov[0].iov_len >= ETH_HLEN + 4 &&
+        !n->host_hdr_len && !n->rss_data.redirect &&
+        n->guest_hdr_len != sizeof(struct virtio_net_hdr_v1_hash) &&
+        !virtio_net_rsc_active(n)) {
+        rcu_read_lock();
+        r = virtio_net_receive_iov_rcu(nc, NULL, iov, iovcnt);
+        rcu_read_unlock();
+        virtio_net_unlock(n);
+        return r;
+    }
+    virtio_net_unlock(n);
+
+    buf = g_malloc(size);
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+    r = virtio_net_receive(nc, buf, size);
+    g_free(buf);
     return r;
 }
 
+static void virtio_net_receive_batch_begin(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtio_net_lock(n);
+    q->rx_batch = true;
+    virtio_net_unlock(n);
+}
+
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtio_net_lock(n);
+    rcu_read_lock();
+    virtio_net_rsc_flush(q);
+    rcu_read_unlock();
+
+    q->rx_batch = false;
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(n, q->rx_vq);
+    }
+    virtio_net_unlock(n);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    virtio_net_lock(n);
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
+    virtio_net_unlock(n);
 }
 
 /* TX */
+
+/* Send one TX element.  Returns 0 once the packet has been sent or dropped,
+ * -EBUSY if the peer queued it, in which case it now belongs to q->async_tx,
+ * or -EINVAL if it was malformed and has already been detached and freed.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    /* The peer may queue the packet by reference, keep the header around */
+    struct virtio_net_hdr_v1_hash *mhdr = &q->async_tx.hdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        virtqueue_detach_element(q->tx_vq, elem, 0);
+        virtqueue_element_free(elem);
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            virtqueue_detach_element(q->tx_vq, elem, 0);
+            virtqueue_element_free(elem);
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) mhdr);
+            sg2[0].iov_base = mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                return 0;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    if (!nc->peer) {
+        /* An rss_queues pair without a backend queue of its own.  The
+         * packet is copied if the backend is busy, so it is done with.
+         */
+        qemu_sendv_packet(qemu_get_queue(n->nic), out_sg, out_num);
+        return 0;
+    }
+
+    ret = qemu_sendv_packet_async(nc, out_sg, out_num,
+                                  virtio_net_tx_complete);
+    if (ret == 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        q->async_tx.elem = elem;
+        return -EBUSY;
+    }
+    return 0;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
+    static const unsigned int lens[VIRTIO_NET_TX_BATCH];
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -1327,80 +2275,48 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+    while (num_packets < n->tx_burst) {
+        unsigned int i, j, count;
+        int ret = 0;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        count = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                    (void **)elems,
+                                    MIN(VIRTIO_NET_TX_BATCH,
+                                        n->tx_burst - num_packets));
+        if (!count) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (i = 0; i < count; i++) {
+            ret = virtio_net_tx_one(q, elems[i]);
+            if (ret < 0) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
+        /* Everything before elems[i] is done, complete it in one go */
+        if (i) {
+            virtqueue_push_batch(q->tx_vq, elems, lens, i);
+            virtio_net_notify(n, q->tx_vq);
+            for (j = 0; j < i; j++) {
+                virtqueue_element_free(elems[j]);
             }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
+            num_packets += i;
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
-        }
-
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (ret == -EBUSY) {
+            /* Give the rest back until the peer has drained its queue */
+            for (j = count - 1; j > i; j--) {
+                virtqueue_unpop(q->tx_vq, elems[j], 0);
+                virtqueue_element_free(elems[j]);
+            }
+            return -EBUSY;
+        } else if (ret < 0) {
+            for (j = i + 1; j < count; j++) {
+                virtqueue_detach_element(q->tx_vq, elems[j], 0);
+                virtqueue_element_free(elems[j]);
+            }
+            return ret;
         }
     }
     return num_packets;
@@ -1459,9 +2375,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     qemu_bh_schedule(q->tx_bh);
 }
 
-static void virtio_net_tx_timer(void *opaque)
+static void virtio_net_flush_tx_timer(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     /* This happens when device was stopped but BH wasn't. */
@@ -1482,9 +2397,8 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+static void virtio_net_flush_tx_bh(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int32_t ret;
@@ -1531,6 +2445,217 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_tx_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_lock(q->n);
+    virtio_net_flush_tx_timer(q);
+    virtio_net_unlock(q->n);
+}
+
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_lock(q->n);
+    virtio_net_flush_tx_bh(q);
+    virtio_net_unlock(q->n);
+}
+
+/* IOThread */
+
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    virtio_net_lock(n);
+    virtio_net_handle_rx(vdev, vq);
+    virtio_net_unlock(n);
+
+    /* New rx buffers only matter once the peer has something for them, so
+     * do not let a non-empty rx ring keep the poll loop spinning.
+     */
+    return false;
+}
+
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    bool progress;
+
+    virtio_net_lock(n);
+    progress = !q->tx_waiting;
+    if (q->tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+    virtio_net_unlock(n);
+    return progress;
+}
+
+/* Recreate the TX timer or bottom half in @ctx.  Anything pending is
+ * dropped; q->tx_waiting makes virtio_net_set_status() schedule it again.
+ */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+        timer_free(q->tx_timer);
+        q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                    virtio_net_tx_timer, q);
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static int virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    /* Filters can be added after realize */
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (peer && !qemu_net_supports_aio_context(peer)) {
+            error_report("virtio-net: netdev '%s' cannot be used with "
+                         "iothread, using the main loop", peer->name);
+            return -ENOTSUP;
+        }
+    }
+
+    /* The control queue falls back to being handled in the vCPU thread */
+    r = virtio_device_grab_ioeventfd(vdev);
+    if (r < 0) {
+        error_report("virtio-net: binding does not support host notifiers");
+        return r;
+    }
+
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r < 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_guest_notifiers;
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r < 0) {
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+            }
+            goto fail_host_notifiers;
+        }
+    }
+
+    aio_context_acquire(n->ctx);
+    n->dataplane_queues = queues;
+    n->dataplane_started = true;
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_tx_set_aio_context(q, n->ctx);
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, n->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx,
+                virtio_net_dataplane_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+                virtio_net_dataplane_handle_tx);
+
+        /* Kick right away to pick up buffers already in the rings */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+    }
+    aio_context_release(n->ctx);
+    return 0;
+
+fail_host_notifiers:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+fail_guest_notifiers:
+    virtio_device_release_ioeventfd(vdev);
+    return r;
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONet *n = opaque;
+    int i;
+
+    for (i = 0; i < n->dataplane_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, n->ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx, NULL);
+        qemu_net_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = n->dataplane_queues * 2;
+    int i;
+
+    aio_context_acquire(n->ctx);
+    aio_wait_bh_oneshot(n->ctx, virtio_net_dataplane_stop_bh, n);
+    for (i = 0; i < n->dataplane_queues; i++) {
+        virtio_net_tx_set_aio_context(&n->vqs[i], qemu_get_aio_context());
+    }
+    n->dataplane_started = false;
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    virtio_device_release_ioeventfd(vdev);
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    bool run;
+
+    if (!n->ctx) {
+        return;
+    }
+
+    /* vhost moves the rings out of QEMU altogether and wins */
+    run = virtio_net_started(n, status) && !n->vhost_started;
+    if (!run) {
+        /* Better luck next time */
+        n->dataplane_disabled = false;
+    }
+    if (run == n->dataplane_started || (run && n->dataplane_disabled)) {
+        return;
+    }
+
+    if (run) {
+        /* On failure the queues are processed in the main loop, like
+         * without an iothread; do not retry on every status change */
+        if (virtio_net_dataplane_start(n) < 0) {
+            n->dataplane_disabled = true;
+        }
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1552,6 +2677,12 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    if (n->net_conf.rsc) {
+        n->vqs[index].rsc_timer = timer_new_ns(QEMU_CLOCK_HOST,
+                                               virtio_net_rsc_timer,
+                                               &n->vqs[index]);
+    }
+
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -1563,6 +2694,7 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     NetClientState *nc = qemu_get_subqueue(n->nic, index);
 
     qemu_purge_queued_packets(nc);
+    virtio_net_rsc_cleanup(q);
 
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
@@ -1630,7 +2762,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                               VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1829,6 +2963,50 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    int i;
+
+    if (!is_power_of_2(n->rss_data.indirections_len) ||
+        n->rss_data.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        n->rss_data.default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < n->rss_data.indirections_len; i++) {
+        if (n->rss_data.indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_BOOL(rss_data.populate_hash, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1879,6 +3057,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    },
 };
 
 static NetClientInfo net_virtio_info = {
@@ -1886,6 +3068,9 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov = virtio_net_receive_iov,
+    .receive_batch_begin = virtio_net_receive_batch_begin,
+    .receive_batch_end = virtio_net_receive_batch_end,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1965,6 +3150,27 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->host_features |= (1ULL << VIRTIO_NET_F_SPEED_DUPLEX);
     }
 
+    if (n->net_conf.iothread) {
+        BusState *qbus = qdev_get_parent_bus(dev);
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+            error_setg(errp, "iothread requires a transport with "
+                       "ioeventfd support");
+            return;
+        }
+        for (i = 0; i < n->nic_conf.peers.queues; i++) {
+            NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+            if (peer && !qemu_net_supports_aio_context(peer)) {
+                error_setg(errp, "netdev '%s' cannot be used with iothread",
+                           peer->name);
+                return;
+            }
+        }
+        n->ctx = iothread_get_aio_context(n->net_conf.iothread);
+    }
+
     virtio_net_set_config_size(n, n->host_features);
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
@@ -1996,6 +3202,23 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     }
 
     n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    if (n->net_conf.rss_queues > n->max_queues) {
+        if (!virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+            !virtio_has_feature(n->host_features, VIRTIO_NET_F_CTRL_VQ)) {
+            error_setg(errp, "rss_queues larger than the number of backend "
+                       "queues requires rss=on and ctrl_vq=on");
+            virtio_cleanup(vdev);
+            return;
+        }
+        if (get_vhost_net(n->nic_conf.peers.ncs[0])) {
+            error_setg(errp, "rss_queues is not supported with vhost");
+            virtio_cleanup(vdev);
+            return;
+        }
+        /* The extra queue pairs get a NIC queue without a peer */
+        n->max_queues = n->net_conf.rss_queues;
+        n->nic_conf.peers.queues = n->max_queues;
+    }
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
                    "must be a positive integer less than %d.",
@@ -2040,6 +3263,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
                               object_get_typename(OBJECT(dev)), dev->id, n);
     }
 
+    /* A TX element is only completed by virtio_net_tx_complete() */
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_get_subqueue(n->nic, i)->send_nocopy = 1;
+    }
+
     peer_test_vnet_hdr(n);
     if (peer_has_vnet_hdr(n)) {
         for (i = 0; i < n->max_queues; i++) {
@@ -2054,13 +3282,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
 
     n->vlans = g_malloc0(MAX_VLAN >> 3);
 
+    net_rx_pkt_init(&n->rx_pkt, false);
+
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
@@ -2084,6 +3314,8 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
+    net_rx_pkt_uninit(n->rx_pkt);
+
     max_queues = n->multiqueue ? n->max_queues : 1;
     for (i = 0; i < max_queues; i++) {
         virtio_net_del_queue(n, i);
@@ -2173,6 +3405,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -2187,6 +3423,12 @@ static Property virtio_net_properties[] = {
                      true),
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
+    DEFINE_PROP_BOOL("rsc", VirtIONet, net_conf.rsc, false),
+    DEFINE_PROP_UINT32("x-rsc-interval", VirtIONet, net_conf.rsc_interval,
+                       RSC_TIMER_INTERVAL),
+    DEFINE_PROP_UINT16("rss_queues", VirtIONet, net_conf.rss_queues, 0),
+    DEFINE_PROP_LINK("iothread", VirtIONet, net_conf.iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
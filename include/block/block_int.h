@@ -117,6 +117,12 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /* Set if requests may be submitted to the driver from several
+     * AioContexts at once, see blk_set_multiqueue().  Only meaningful for
+     * the root node of a BlockBackend.
+     */
+    bool supports_multiqueue;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -60,6 +60,9 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t searched_pc);
 
 void QEMU_NORETURN cpu_loop_exit_noexc(CPUState *cpu);
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
+void QEMU_NORETURN cpu_superblock_recompile(CPUState *cpu,
+                                            TranslationBlock *tb,
+                                            uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               uint32_t flags,
@@ -96,6 +99,19 @@ void cpu_address_space_init(CPUState *cpu, int asidx,
 
 #if !defined(CONFIG_USER_ONLY) && defined(CONFIG_TCG)
 /* cputlb.c */
+/**
+ * tlb_init - initialize a CPU's TLB
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB tables of @cpu, for TCG backends that size them
+ * dynamically.  Must be called before the first flush of @cpu's TLB.
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy - destroy a CPU's TLB
+ * @cpu: CPU whose TLB should be destroyed
+ */
+void tlb_destroy(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -126,6 +142,18 @@ void tlb_flush_page_all_cpus(CPUState *src, target_ulong addr);
  * the guests translation ends the TB.
  */
 void tlb_flush_page_all_cpus_synced(CPUState *src, target_ulong addr);
+/**
+ * tlb_flush_range:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ *
+ * Flush the pages overlapping [@addr, @addr + @len) from the TLB of the
+ * specified CPU, for all MMU indexes.  Unlike a loop over tlb_flush_page
+ * this is a single work item, and it falls back to flushing whole MMU
+ * indexes if the range is larger than their TLB.
+ */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
 /**
  * tlb_flush:
  * @cpu: CPU whose TLB should be flushed
@@ -256,6 +284,12 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
 void probe_write(CPUArchState *env, target_ulong addr, int size, int mmu_idx,
                  uintptr_t retaddr);
 #else
+static inline void tlb_init(CPUState *cpu)
+{
+}
+static inline void tlb_destroy(CPUState *cpu)
+{
+}
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
 }
@@ -266,6 +300,10 @@ static inline void tlb_flush_page_all_cpus_synced(CPUState *src,
                                                   target_ulong addr)
 {
 }
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
 static inline void tlb_flush(CPUState *cpu)
 {
 }
@@ -343,6 +381,7 @@ struct TranslationBlock {
 #define CF_USE_ICOUNT  0x00020000
 #define CF_INVALID     0x00040000 /* TB is stale. Setters need tb_lock */
 #define CF_PARALLEL    0x00080000 /* Generate code for a parallel context */
+#define CF_SUPERBLOCK  0x00100000 /* TB spans a hot path of several blocks */
 /* cflags' mask for hashing/comparison */
 #define CF_HASH_MASK   \
     (CF_COUNT_MASK | CF_LAST_IO | CF_USE_ICOUNT | CF_PARALLEL)
@@ -350,6 +389,15 @@ struct TranslationBlock {
     /* Per-vCPU dynamic tracing state used to generate this TB */
     uint32_t trace_vcpu_dstate;
 
+    /*
+     * Number of times the TB has been entered, counted by the TB itself
+     * when superblocks are enabled. Once it reaches TB_HOT_THRESHOLD the
+     * TB is retranslated as a superblock (CF_SUPERBLOCK), which does not
+     * count its executions anymore.
+     */
+    uint32_t exec_count;
+#define TB_HOT_THRESHOLD 1000
+
     struct tb_tc tc;
 
     /* original tb when cflags has CF_NOCACHE */
@@ -387,6 +435,7 @@ struct TranslationBlock {
 };
 
 extern bool parallel_cpus;
+extern bool tcg_superblocks_enabled;
 
 /* Hide the atomic_read to make code a little easier on the eyes */
 static inline uint32_t tb_cflags(const TranslationBlock *tb)
@@ -407,6 +456,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
                                    target_ulong cs_base, uint32_t flags,
                                    uint32_t cf_mask);
+uint32_t tb_exec_count_hint(const TranslationBlock *tb, target_ulong pc);
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr);
 
 /* GETPC is the true target of the return instruction that we'll execute.  */
@@ -38,6 +38,9 @@ struct TBContext {
 
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_evict_count;
+    size_t tb_evict_tb_count;
+    size_t tb_superblock_count;
     int tb_phys_invalidate_count;
 };
 
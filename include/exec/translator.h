@@ -59,6 +59,9 @@ typedef enum DisasJumpType {
  * @is_jmp: What instruction to disassemble next.
  * @num_insns: Number of translated instructions (including current).
  * @singlestep_enabled: "Hardware" single stepping enabled.
+ * @loop_head: For superblocks (CF_SUPERBLOCK), label at the start of the TB,
+ *             ahead of the exit request check, that a loop back edge may
+ *             branch to without leaving the TB; NULL otherwise.
  *
  * Architecture-agnostic disassembly context.
  */
@@ -69,6 +72,7 @@ typedef struct DisasContextBase {
     DisasJumpType is_jmp;
     unsigned int num_insns;
     bool singlestep_enabled;
+    TCGLabel *loop_head;
 } DisasContextBase;
 
 /**
@@ -135,10 +139,29 @@ typedef struct TranslatorOps {
  * - When the TCG operation buffer is full.
  * - When single-stepping is enabled (system-wide or on the current vCPU).
  * - When too many instructions have been translated.
+ *
+ * When superblocks are enabled, code is emitted at the start of the TB to
+ * count its executions; once hot, the TB is retranslated with CF_SUPERBLOCK.
  */
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb);
 
 void translator_loop_temp_check(DisasContextBase *db);
 
+/**
+ * translator_prefer_taken:
+ * @db: Disassembly context.
+ * @taken: Guest address of the branch target.
+ * @not_taken: Guest address of the fall-through path.
+ *
+ * Guess which way a conditional branch goes, for frontends that extend
+ * superblocks (CF_SUPERBLOCK) past conditional branches. The guess is based
+ * on how often the TBs for either path have been executed; paths outside
+ * the guest page of @db->pc_first count as cold.
+ *
+ * Returns true if the branch target looks hotter than the fall-through path.
+ */
+bool translator_prefer_taken(const DisasContextBase *db,
+                             target_ulong taken, target_ulong not_taken);
+
 #endif  /* EXEC__TRANSLATOR_H */
@@ -628,6 +628,10 @@ static inline uint64_t estimateDiv128To64(uint64_t a0, uint64_t a1, uint64_t b)
 /* From the GNU Multi Precision Library - longlong.h __udiv_qrnnd
  * (https://gmplib.org/repo/gmp/file/tip/longlong.h)
  *
+ * Divides the 128-bit value n1:n0 by @d.  @d must be normalized, i.e. have
+ * its msb set, and n1 must be less than @d.  The lsb of the quotient is
+ * or'ed with whether the remainder is non-zero.
+ *
  * Licensed under the GPLv2/LGPLv3
  */
 static inline uint64_t div128To64(uint64_t n0, uint64_t n1, uint64_t d)
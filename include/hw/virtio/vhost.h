@@ -37,6 +37,14 @@ struct vhost_log {
     vhost_log_chunk_t *log;
 };
 
+struct vhost_inflight {
+    int fd;
+    void *addr;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t queue_size;
+};
+
 struct vhost_dev;
 struct vhost_iommu {
     struct vhost_dev *hdev;
@@ -120,4 +128,12 @@ int vhost_dev_set_config(struct vhost_dev *dev, const uint8_t *data,
  */
 void vhost_dev_set_config_notifier(struct vhost_dev *dev,
                                    const VhostDevConfigOps *ops);
+
+/* Buffer shared with the backend to track inflight I/O across restarts
+ */
+void vhost_dev_free_inflight(struct vhost_inflight *inflight);
+int vhost_dev_set_inflight(struct vhost_dev *dev,
+                           struct vhost_inflight *inflight);
+int vhost_dev_get_inflight(struct vhost_dev *dev, uint16_t queue_size,
+                           struct vhost_inflight *inflight);
 #endif
@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothread_vq_mapping;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -48,7 +49,8 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    void *rq;
+    QemuMutex rq_lock;
+    void *rq; /* protected by rq_lock */
     QEMUBH *bh;
     VirtIOBlkConf conf;
     unsigned short sector_mask;
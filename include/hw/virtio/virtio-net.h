@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -30,6 +31,9 @@
  * and latency. */
 #define TX_BURST 256
 
+/* How long a partially coalesced receive flow may be held back */
+#define RSC_TIMER_INTERVAL 300000 /* 300 us */
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
@@ -41,8 +45,42 @@ typedef struct virtio_net_conf
     int32_t speed;
     char *duplex_str;
     uint8_t duplex;
+    bool rsc;
+    uint32_t rsc_interval;
+    uint16_t rss_queues;
+    IOThread *iothread;
 } virtio_net_conf;
 
+/* Limits advertised to the guest in the config space */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
+typedef struct VirtioNetRssData {
+    bool enabled;
+    bool redirect;
+    bool populate_hash;
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;
+
+    /* Hash of the packet that virtio_net_receive() is steering, so that it
+     * is not computed again for the hash report */
+    const uint8_t *pkt_buf;
+    uint32_t pkt_hash;
+    uint16_t pkt_hash_report;
+} VirtioNetRssData;
+
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
@@ -54,7 +92,14 @@ typedef struct VirtIONetQueue {
     uint32_t tx_waiting;
     struct {
         VirtQueueElement *elem;
+        struct virtio_net_hdr_v1_hash hdr;
     } async_tx;
+    /* RX notifications are deferred until the peer's batch ends */
+    bool rx_batch;
+    bool rx_notify_pending;
+    /* Receive segment coalescing, allocated on first use */
+    struct VirtIONetRscFlow *rsc_flows;
+    QEMUTimer *rsc_timer;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -102,6 +147,15 @@ typedef struct VirtIONet {
     int announce_counter;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    VirtioNetRssData rss_data;
+    struct NetRxPkt *rx_pkt;
+    /* Data queues are serviced in this context when iothread is set */
+    AioContext *ctx;
+    bool dataplane_started;
+    /* Set when starting the IOThread failed; queues stay in the main loop
+     * until the device is stopped */
+    bool dataplane_disabled;
+    int dataplane_queues;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -0,0 +1,40 @@
+/*
+ * Virtio packed ring helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VIRTIO_PACKED_H
+#define QEMU_VIRTIO_PACKED_H
+
+#include "standard-headers/linux/virtio_ring.h"
+
+/*
+ * Packed ring counterpart of vring_need_event().  The used index moved
+ * from @old to @new on a ring of @num entries, and @wrap is the used wrap
+ * counter after the move.  @off_wrap is the driver's event offset, with
+ * the wrap counter of the lap it refers to in its top bit.
+ *
+ * If the used index wrapped, @old is in the previous lap.  The event is
+ * either in @old's lap or in the one after it, so an event whose wrap
+ * counter differs from @old's is moved one lap ahead.
+ */
+static inline bool vring_packed_need_event(uint16_t num, bool wrap,
+                                           uint16_t off_wrap,
+                                           uint16_t new, uint16_t old)
+{
+    bool old_wrap = wrap;
+    uint16_t off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (new < old) {
+        new += num;
+        old_wrap = !wrap;
+    }
+    if (old_wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off += num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+#endif
@@ -4304,6 +4304,16 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_superblocks(const char *arg)
+{
+#ifdef TCG_GUEST_SUPERBLOCKS
+    tcg_superblocks_enabled = true;
+#else
+    fprintf(stderr, "TCG superblocks are not supported by this target\n");
+    exit(EXIT_FAILURE);
+#endif
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -4368,6 +4378,8 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"superblocks", "QEMU_SUPERBLOCKS", false, handle_arg_superblocks,
+     "",           "retranslate hot code paths as superblocks"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_randseed,
@@ -0,0 +1,169 @@
+/*
+ * Page compression methods for migration compress threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "qapi/error.h"
+#include "compress.h"
+
+/* Little-endian zstd frame magic, see RFC 8478 section 3.1.1 */
+#define MIG_ZSTD_MAGIC 0xFD2FB528
+
+struct MigCompressor {
+    CompressMethod method;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zcctx;
+#endif
+};
+
+struct MigDecompressor {
+#ifdef CONFIG_ZSTD
+    ZSTD_DCtx *zdctx;
+#else
+    char unused;
+#endif
+};
+
+size_t mig_compress_bound_any(size_t size)
+{
+    size_t bound = compressBound(size);
+
+#ifdef CONFIG_ZSTD
+    bound = MAX(bound, ZSTD_compressBound(size));
+#endif
+    return bound;
+}
+
+MigCompressor *mig_compressor_new(CompressMethod method, Error **errp)
+{
+    MigCompressor *c;
+
+    switch (method) {
+    case COMPRESS_METHOD_ZLIB:
+        break;
+    case COMPRESS_METHOD_ZSTD:
+#ifdef CONFIG_ZSTD
+        break;
+#else
+        error_setg(errp, "zstd compression is not supported by this binary");
+        return NULL;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+
+    c = g_new0(MigCompressor, 1);
+    c->method = method;
+#ifdef CONFIG_ZSTD
+    if (method == COMPRESS_METHOD_ZSTD) {
+        c->zcctx = ZSTD_createCCtx();
+        if (!c->zcctx) {
+            error_setg(errp, "failed to create zstd compression context");
+            g_free(c);
+            return NULL;
+        }
+    }
+#endif
+    return c;
+}
+
+void mig_compressor_free(MigCompressor *c)
+{
+    if (!c) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(c->zcctx);
+#endif
+    g_free(c);
+}
+
+size_t mig_compress_bound(MigCompressor *c, size_t size)
+{
+#ifdef CONFIG_ZSTD
+    if (c->method == COMPRESS_METHOD_ZSTD) {
+        return ZSTD_compressBound(size);
+    }
+#endif
+    return compressBound(size);
+}
+
+ssize_t mig_compress(MigCompressor *c, uint8_t *dst, size_t dst_len,
+                     const uint8_t *src, size_t len, int level)
+{
+#ifdef CONFIG_ZSTD
+    if (c->method == COMPRESS_METHOD_ZSTD) {
+        size_t ret = ZSTD_compressCCtx(c->zcctx, dst, dst_len, src, len,
+                                       level);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+        return ret;
+    }
+#endif
+    {
+        uLongf blen = dst_len;
+
+        if (compress2(dst, &blen, src, len, level) != Z_OK) {
+            return -1;
+        }
+        return blen;
+    }
+}
+
+MigDecompressor *mig_decompressor_new(void)
+{
+    MigDecompressor *d = g_new0(MigDecompressor, 1);
+
+#ifdef CONFIG_ZSTD
+    /* A failure here only matters if the source actually sends zstd */
+    d->zdctx = ZSTD_createDCtx();
+#endif
+    return d;
+}
+
+void mig_decompressor_free(MigDecompressor *d)
+{
+    if (!d) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeDCtx(d->zdctx);
+#endif
+    g_free(d);
+}
+
+ssize_t mig_decompress(MigDecompressor *d, uint8_t *dst, size_t dst_len,
+                       const uint8_t *src, size_t src_len)
+{
+    uLongf dlen = dst_len;
+
+    if (src_len >= 4 && (uint32_t)ldl_le_p(src) == MIG_ZSTD_MAGIC) {
+#ifdef CONFIG_ZSTD
+        size_t ret;
+
+        if (!d->zdctx) {
+            return -1;
+        }
+        ret = ZSTD_decompressDCtx(d->zdctx, dst, dst_len, src, src_len);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+        return ret;
+#else
+        return -1;
+#endif
+    }
+
+    if (uncompress(dst, &dlen, src, src_len) != Z_OK) {
+        return -1;
+    }
+    return dlen;
+}
@@ -0,0 +1,54 @@
+/*
+ * Page compression methods for migration compress threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi/qapi-types-migration.h"
+
+typedef struct MigCompressor MigCompressor;
+typedef struct MigDecompressor MigDecompressor;
+
+/*
+ * Worst case size of a compressed buffer for @size input bytes, for
+ * any of the methods we support.  Used to size the receive buffers,
+ * since the destination does not know which method the source uses.
+ */
+size_t mig_compress_bound_any(size_t size);
+
+/*
+ * Create a compression context for @method.  Each compress thread owns
+ * one, so that libraries with per-stream state (zstd) do not have to
+ * allocate it for every page.
+ */
+MigCompressor *mig_compressor_new(CompressMethod method, Error **errp);
+void mig_compressor_free(MigCompressor *c);
+size_t mig_compress_bound(MigCompressor *c, size_t size);
+
+/*
+ * Compress @len bytes from @src into @dst at @level.  @dst must be at
+ * least mig_compress_bound() bytes long.
+ *
+ * Returns the compressed size, or -1 on failure.
+ */
+ssize_t mig_compress(MigCompressor *c, uint8_t *dst, size_t dst_len,
+                     const uint8_t *src, size_t len, int level);
+
+MigDecompressor *mig_decompressor_new(void);
+void mig_decompressor_free(MigDecompressor *d);
+
+/*
+ * Decompress @src_len bytes from @src into @dst.  The method is
+ * detected from the data itself: zstd frames start with a fixed magic
+ * number, everything else is handed to zlib.
+ *
+ * Returns the decompressed size, or -1 on failure.
+ */
+ssize_t mig_decompress(MigDecompressor *d, uint8_t *dst, size_t dst_len,
+                       const uint8_t *src, size_t src_len);
+
+#endif
@@ -68,6 +68,8 @@
 #define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
 /*0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+/* Highest compression level accepted by the zstd compress method */
+#define MAX_MIGRATE_ZSTD_COMPRESS_LEVEL 22
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
@@ -430,7 +432,7 @@ static void migration_incoming_setup(QEMUFile *f)
     qemu_file_set_blocking(f, false);
 }
 
-static void migration_incoming_process(void)
+void migration_incoming_process(void)
 {
     Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, NULL);
     qemu_coroutine_enter(co);
@@ -448,9 +450,16 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
 
     if (!mis->from_src_file) {
         QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        migration_incoming_setup(f);
+        if (migration_has_all_channels()) {
+            migration_incoming_process();
+        }
+    } else {
+        /* The main channel always connects first, the rest are multifd.
+         * The migration starts once the last one has identified itself.
+         */
+        multifd_recv_new_channel(ioc);
     }
-    /* We still only have a single channel.  Nothing to do here yet */
 }
 
 /**
@@ -461,7 +470,9 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
  */
 bool migration_has_all_channels(void)
 {
-    return true;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    return mis->from_src_file && multifd_recv_all_channels_created();
 }
 
 /*
@@ -556,6 +567,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
 
     return params;
 }
@@ -605,9 +618,16 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->pages = xbzrle_counters.pages;
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_eviction = xbzrle_counters.cache_eviction;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
     }
 
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = ram_compression_stats();
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
@@ -724,6 +744,16 @@ static bool migrate_caps_check(bool *cap_list,
     }
 #endif
 
+    /* multifd sends full pages on its own channels, while XBZRLE encodes
+     * pages against the cache on the main stream.  The two could be
+     * combined, but for now XBZRLE would be silently unused.
+     */
+    if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD] &&
+        cap_list[MIGRATION_CAPABILITY_XBZRLE]) {
+        error_setg(errp, "XBZRLE is not currently compatible with multifd");
+        return false;
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
         if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
             /* The decompression threads asynchronously write into RAM
@@ -736,6 +766,15 @@ static bool migrate_caps_check(bool *cap_list,
             return false;
         }
 
+        /* Pages arrive on the multifd channels out of order with respect
+         * to the main stream, which postcopy relies on.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            error_setg(errp, "Postcopy is not currently compatible "
+                       "with multifd");
+            return false;
+        }
+
         /* This check is reasonably expensive, so only when it's being
          * set the first time, also it's only the destination that needs
          * special support.
@@ -781,8 +820,21 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
  */
 static bool migrate_params_check(MigrationParameters *params, Error **errp)
 {
-    if (params->has_compress_level &&
-        (params->compress_level > 9)) {
+    if (params->has_compress_method &&
+        params->compress_method == COMPRESS_METHOD_ZSTD) {
+#ifndef CONFIG_ZSTD
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_method",
+                   "zlib (zstd support is not compiled in)");
+        return false;
+#endif
+        if (params->has_compress_level &&
+            params->compress_level > MAX_MIGRATE_ZSTD_COMPRESS_LEVEL) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                       "is invalid, it should be in the range of 0 to 22");
+            return false;
+        }
+    } else if (params->has_compress_level &&
+               (params->compress_level > 9)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
                    "is invalid, it should be in the range of 0 to 9");
         return false;
@@ -925,6 +977,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
+    if (params->has_compress_method) {
+        dest->compress_method = params->compress_method;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -997,6 +1052,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
     }
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1196,6 +1254,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING) {
+        multifd_save_shutdown();
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1558,6 +1619,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+CompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -2592,6 +2662,7 @@ static void migration_instance_init(Object *obj)
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
     params->has_xbzrle_cache_size = true;
+    params->has_compress_method = true;
 }
 
 /*
@@ -187,6 +187,7 @@ struct MigrationState
 void migrate_set_state(int *state, int old_state, int new_state);
 
 void migration_fd_process_incoming(QEMUFile *f);
+void migration_incoming_process(void);
 void migration_ioc_process_incoming(QIOChannel *ioc);
 
 bool  migration_has_all_channels(void);
@@ -227,6 +228,7 @@ bool migrate_use_return_path(void);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+CompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by a hash of the page
+ * address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -31,19 +32,33 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* Number of pages that can live in each set of the cache */
+#define PAGE_CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
+/*
+ * The cache is set-associative: a page can live in any of the @ways
+ * items of the set its address hashes to.  Within a set, the least
+ * recently used page is replaced, unless it was used in the last
+ * CACHED_PAGE_LIFETIME bitmap generations.  Items are stored set by
+ * set, so a lookup only touches @ways consecutive entries.
+ */
 struct PageCache {
     CacheItem *page_cache;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t ways;
+    unsigned set_bits;
+    uint64_t lru_clock;
 };
 
 PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
@@ -75,8 +90,12 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->set_bits = ctz64(num_pages / cache->ways);
+    cache->lru_clock = 0;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %zu, %zu ways\n",
+            cache->max_num_items, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -91,6 +110,7 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_lru = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -113,40 +133,54 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
-{
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
-}
-
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Return the first item of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    uint64_t set = 0;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    /* Fibonacci hashing, so that strided access patterns still spread
+     * over all sets.
+     */
+    if (cache->set_bits) {
+        set = ((address / cache->page_size) * 0x9e3779b97f4a7c15ULL)
+              >> (64 - cache->set_bits);
+    }
+    return &cache->page_cache[set * cache->ways];
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    size_t i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
         return true;
     }
     return false;
@@ -155,17 +189,34 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
+    CacheItem *set, *it = NULL;
+    int ret = 0;
+    size_t i;
+
+    set = cache_get_set(cache, addr);
+
+    /* Prefer the page itself, then a free item, then the LRU one */
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            if (!it || it->it_data) {
+                it = &set[i];
+            }
+        } else if (set[i].it_addr == addr) {
+            it = &set[i];
+            break;
+        } else if (!it || (it->it_data && set[i].it_lru < it->it_lru)) {
+            it = &set[i];
+        }
+    }
 
-    CacheItem *it;
-
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (it->it_data && it->it_addr != addr) {
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* even the oldest page of the set is fresh, don't replace it */
+            return -1;
+        }
+        ret = 1;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -179,7 +230,8 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
@@ -22,12 +22,12 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "compress.h"
 #include "trace.h"
 
 #define IO_BUF_SIZE 32768
@@ -309,6 +309,15 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for @len bytes that were sent on behalf of @f through another
+ * channel, so that they count against the rate limit of @f.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -658,8 +667,9 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* Compress size bytes of data start at p with specific compression
- * level and store the compressed data to the buffer of f.
+/* Compress size bytes of data start at p with the compressor c at
+ * the specific compression level and store the compressed data to
+ * the buffer of f.
  *
  * When f is not writable, return -1 if f has no space to save the
  * compressed data.
@@ -668,23 +678,25 @@ uint64_t qemu_get_be64(QEMUFile *f)
  * data, return -1.
  */
 
-ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
-                                  int level)
+ssize_t qemu_put_compression_data(QEMUFile *f, MigCompressor *c,
+                                  const uint8_t *p, size_t size, int level)
 {
     ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+    size_t bound = mig_compress_bound(c, size);
 
-    if (blen < compressBound(size)) {
+    if (blen < bound) {
         if (!qemu_file_is_writable(f)) {
             return -1;
         }
         qemu_fflush(f);
         blen = IO_BUF_SIZE - sizeof(int32_t);
-        if (blen < compressBound(size)) {
+        if (blen < bound) {
             return -1;
         }
     }
-    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
-                  (Bytef *)p, size, level) != Z_OK) {
+    blen = mig_compress(c, f->buf + f->buf_index + sizeof(int32_t), blen,
+                        p, size, level);
+    if (blen < 0) {
         error_report("Compress Failed!");
         return 0;
     }
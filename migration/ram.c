@@ -28,7 +28,6 @@
 
 #include "qemu/osdep.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -39,6 +38,7 @@
 #include "migration/register.h"
 #include "migration/misc.h"
 #include "qemu-file.h"
+#include "compress.h"
 #include "postcopy-ram.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
@@ -51,6 +51,9 @@
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
 #include "migration/block.h"
+#include "socket.h"
+#include "sysemu/sysemu.h"
+#include "qemu/uuid.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -264,7 +267,9 @@ typedef struct PageSearchStatus PageSearchStatus;
 struct CompressParam {
     bool done;
     bool quit;
+    int id;
     QEMUFile *file;
+    MigCompressor *comp;
     QemuMutex mutex;
     QemuCond cond;
     RAMBlock *block;
@@ -279,11 +284,35 @@ struct DecompressParam {
     QemuCond cond;
     void *des;
     uint8_t *compbuf;
+    MigDecompressor *decomp;
     int len;
 };
 typedef struct DecompressParam DecompressParam;
 
+/* compress-threads is an uint8 parameter */
+#define MAX_COMPRESS_THREADS 255
+
+struct CompressThreadCounters {
+    uint64_t pages;
+    uint64_t compressed_size;
+    uint64_t busy_ns;
+};
+typedef struct CompressThreadCounters CompressThreadCounters;
+
+/* Each slot has a single writer, either a compress thread or (for
+ * @direct) the migration thread.  They outlive the threads so that
+ * query-migrate can report them once the migration has completed.
+ */
+static struct {
+    CompressMethod method;
+    int thread_count;
+    CompressThreadCounters direct;
+    CompressThreadCounters threads[MAX_COMPRESS_THREADS];
+} compression_counters;
+
 static CompressParam *comp_param;
+/* Used by the migration thread for the first page of each block */
+static MigCompressor *comp_direct;
 static QemuThread *compress_threads;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
@@ -299,14 +328,18 @@ static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(QEMUFile *f, MigCompressor *comp,
+                                RAMBlock *block, ram_addr_t offset);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
+    CompressThreadCounters *counters =
+        &compression_counters.threads[param->id];
     RAMBlock *block;
     ram_addr_t offset;
+    int64_t t0;
+    int bytes;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
@@ -316,7 +349,14 @@ static void *do_data_compress(void *opaque)
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            bytes = do_compress_ram_page(param->file, param->comp,
+                                         block, offset);
+            if (bytes > 0) {
+                counters->pages++;
+                counters->compressed_size += bytes;
+            }
+            counters->busy_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0;
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -351,7 +391,7 @@ static void compress_threads_save_cleanup(void)
 {
     int i, thread_count;
 
-    if (!migrate_use_compression()) {
+    if (!migrate_use_compression() || !comp_param) {
         return;
     }
     terminate_compression_threads();
@@ -359,6 +399,7 @@ static void compress_threads_save_cleanup(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        mig_compressor_free(comp_param[i].comp);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -366,20 +407,49 @@ static void compress_threads_save_cleanup(void)
     qemu_cond_destroy(&comp_done_cond);
     g_free(compress_threads);
     g_free(comp_param);
+    mig_compressor_free(comp_direct);
     compress_threads = NULL;
     comp_param = NULL;
+    comp_direct = NULL;
 }
 
-static void compress_threads_save_setup(void)
+static int compress_threads_save_setup(void)
 {
     int i, thread_count;
+    CompressMethod method;
+    Error *local_err = NULL;
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
     thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
+    method = migrate_compress_method();
+
     comp_param = g_new0(CompressParam, thread_count);
+    comp_direct = mig_compressor_new(method, &local_err);
+    for (i = 0; comp_direct && i < thread_count; i++) {
+        comp_param[i].comp = mig_compressor_new(method, &local_err);
+        if (!comp_param[i].comp) {
+            break;
+        }
+    }
+    if (local_err) {
+        error_report_err(local_err);
+        for (i = 0; i < thread_count; i++) {
+            mig_compressor_free(comp_param[i].comp);
+        }
+        mig_compressor_free(comp_direct);
+        g_free(comp_param);
+        comp_direct = NULL;
+        comp_param = NULL;
+        return -1;
+    }
+
+    memset(&compression_counters, 0, sizeof(compression_counters));
+    compression_counters.method = method;
+    compression_counters.thread_count = thread_count;
+
+    compress_threads = g_new0(QemuThread, thread_count);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
     for (i = 0; i < thread_count; i++) {
@@ -387,6 +457,7 @@ static void compress_threads_save_setup(void)
          * set its ops to empty.
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].id = i;
         comp_param[i].done = true;
         comp_param[i].quit = false;
         qemu_mutex_init(&comp_param[i].mutex);
@@ -395,17 +466,119 @@ static void compress_threads_save_setup(void)
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
+    trace_compress_threads_save_setup(CompressMethod_str(method),
+                                      thread_count);
+    return 0;
+}
+
+/**
+ * ram_compression_stats: build the compression statistics for
+ * query-migrate
+ *
+ * Returns a newly allocated CompressionStats
+ */
+CompressionStats *ram_compression_stats(void)
+{
+    CompressionStats *stats = g_new0(CompressionStats, 1);
+    CompressThreadStatsList **tail = &stats->threads;
+    CompressThreadStatsList *entry;
+    CompressThreadCounters *c;
+    uint64_t pages, compressed_size;
+    int i;
+
+    stats->method = compression_counters.method;
+    pages = compression_counters.direct.pages;
+    compressed_size = compression_counters.direct.compressed_size;
+
+    for (i = 0; i < compression_counters.thread_count; i++) {
+        c = &compression_counters.threads[i];
+        entry = g_new0(CompressThreadStatsList, 1);
+        entry->value = g_new0(CompressThreadStats, 1);
+        entry->value->id = i;
+        entry->value->pages = c->pages;
+        entry->value->compressed_size = c->compressed_size;
+        entry->value->busy_time = c->busy_ns / SCALE_US;
+        *tail = entry;
+        tail = &entry->next;
+
+        pages += c->pages;
+        compressed_size += c->compressed_size;
+    }
+
+    stats->pages = pages;
+    stats->compressed_size = compressed_size;
+    if (compressed_size) {
+        stats->compression_rate = (double)(pages * TARGET_PAGE_SIZE) /
+                                  compressed_size;
+    }
+    return stats;
 }
 
 /* Multiple fd's */
 
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* The receiving side must stop at the next sync point of the main stream */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Same limit as for the x-multifd-page-count parameter */
+#define MULTIFD_MAX_PAGES 10000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char uuid[16]; /* QemuUUID */
+    uint8_t id;
+} __attribute__((packed)) MultiFDInit_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* number of pages that follow the packet */
+    uint32_t used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} __attribute__((packed)) MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* offset of each page inside block */
+    ram_addr_t *offset;
+    /* iov[0] is reserved for the packet header; the page data follows,
+     * with adjacent pages merged into a single entry */
+    struct iovec *iov;
+    /* number of used entries in iov, including the header */
+    uint32_t niov;
+    RAMBlock *block;
+} MultiFDPages_t;
+
 struct MultiFDSendParams {
     uint8_t id;
     char *name;
     QemuThread thread;
+    /* set by the channel thread once connected, protected by the
+     * mutex of multifd_send_state */
+    QIOChannel *c;
     QemuSemaphore sem;
     QemuMutex mutex;
     bool quit;
+    /* the fields below are protected by the mutex of multifd_send_state */
+    bool running;
+    bool pending_job;
+    uint32_t flags;
+    uint64_t packet_num;
+    /* owned by the channel thread while pending_job is set */
+    MultiFDPages_t *pages;
+    /* only used by the channel thread */
+    MultiFDPacket_t *packet;
+    uint64_t num_packets;
+    uint64_t num_pages;
 };
 typedef struct MultiFDSendParams MultiFDSendParams;
 
@@ -413,9 +586,145 @@ struct {
     MultiFDSendParams *params;
     /* number of created threads */
     int count;
+    /* pages being collected by the migration thread */
+    MultiFDPages_t *pages;
+    /* channel to try first for the next batch */
+    int next_channel;
+    uint64_t packet_num;
+    /* protects the channel state; cond is broadcast whenever a channel
+     * becomes idle or fails */
+    QemuMutex mutex;
+    QemuCond cond;
+    bool failed;
 } *multifd_send_state;
 
-static void terminate_multifd_send_threads(Error *errp)
+static MultiFDPages_t *multifd_pages_init(uint32_t size)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->offset = g_new0(ram_addr_t, size);
+    pages->iov = g_new0(struct iovec, size + 1);
+    pages->niov = 1;
+
+    return pages;
+}
+
+static void multifd_pages_reset(MultiFDPages_t *pages)
+{
+    pages->used = 0;
+    pages->niov = 1;
+    pages->block = NULL;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    g_free(pages->offset);
+    g_free(pages->iov);
+    g_free(pages);
+}
+
+/* Add the page at @host to @iov, merging it with the previous entry when
+ * the two are adjacent in memory.  Returns the new number of entries.
+ */
+static uint32_t multifd_iov_add_page(struct iovec *iov, uint32_t niov,
+                                     uint8_t *host, uint32_t first)
+{
+    if (niov > first &&
+        (uint8_t *)iov[niov - 1].iov_base + iov[niov - 1].iov_len == host) {
+        iov[niov - 1].iov_len += TARGET_PAGE_SIZE;
+        return niov;
+    }
+    iov[niov].iov_base = host;
+    iov[niov].iov_len = TARGET_PAGE_SIZE;
+    return niov + 1;
+}
+
+static int multifd_writev_all(QIOChannel *c, struct iovec *iov,
+                              uint32_t niov, Error **errp)
+{
+    uint32_t i, n;
+
+    for (i = 0; i < niov; i += n) {
+        n = MIN(niov - i, IOV_MAX);
+        if (qio_channel_writev_all(c, iov + i, n, errp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int multifd_readv_all(QIOChannel *c, struct iovec *iov,
+                             uint32_t niov, Error **errp)
+{
+    uint32_t i, n;
+
+    for (i = 0; i < niov; i += n) {
+        n = MIN(niov - i, IOV_MAX);
+        if (qio_channel_readv_all(c, iov + i, n, errp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg;
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+    memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
+
+    return qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
+}
+
+static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+{
+    MultiFDInit_t msg;
+
+    if (qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp) < 0) {
+        return -1;
+    }
+
+    be32_to_cpus(&msg.magic);
+    be32_to_cpus(&msg.version);
+
+    if (msg.magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", msg.magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    if (msg.version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", msg.version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    if (memcmp(msg.uuid, &qemu_uuid, sizeof(qemu_uuid))) {
+        char *uuid = qemu_uuid_unparse_strdup(&qemu_uuid);
+        char *msg_uuid = qemu_uuid_unparse_strdup((const QemuUUID *)msg.uuid);
+
+        error_setg(errp, "multifd: received uuid '%s' and expected "
+                   "uuid '%s' for channel %hhd", msg_uuid, uuid, msg.id);
+        g_free(uuid);
+        g_free(msg_uuid);
+        return -1;
+    }
+
+    if (msg.id >= migrate_multifd_channels()) {
+        error_setg(errp, "multifd: received channel id %d but only %d "
+                   "channels are configured", msg.id,
+                   migrate_multifd_channels());
+        return -1;
+    }
+
+    return msg.id;
+}
+
+static void multifd_send_terminate_threads(bool shutdown)
 {
     int i;
 
@@ -427,6 +736,31 @@ static void terminate_multifd_send_threads(Error *errp)
         qemu_sem_post(&p->sem);
         qemu_mutex_unlock(&p->mutex);
     }
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    for (i = 0; shutdown && i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        /* Kick threads that are stuck in a write */
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+    }
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+}
+
+/**
+ * multifd_save_shutdown: stop the multifd channels of a cancelled migration
+ *
+ * Shuts down the sockets, so that neither the channel threads nor the
+ * migration thread waiting for them block on a dead connection.
+ */
+void multifd_save_shutdown(void)
+{
+    if (!multifd_send_state) {
+        return;
+    }
+    multifd_send_terminate_threads(true);
 }
 
 int multifd_save_cleanup(Error **errp)
@@ -434,55 +768,323 @@ int multifd_save_cleanup(Error **errp)
     int i;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_send_state) {
         return 0;
     }
-    terminate_multifd_send_threads(NULL);
+    /* Normally all the work has been queued before we get here, and the
+     * threads finish it before looking at quit.
+     */
+    multifd_send_terminate_threads(migration_has_failed(migrate_get_current()));
     for (i = 0; i < multifd_send_state->count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         qemu_thread_join(&p->thread);
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+            p->c = NULL;
+        }
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         g_free(p->name);
         p->name = NULL;
-    }
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        g_free(p->packet);
+        p->packet = NULL;
+    }
+    socket_send_channel_destroy();
+    qemu_mutex_destroy(&multifd_send_state->mutex);
+    qemu_cond_destroy(&multifd_send_state->cond);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
+    multifd_pages_clear(multifd_send_state->pages);
+    multifd_send_state->pages = NULL;
     g_free(multifd_send_state);
     multifd_send_state = NULL;
     return ret;
 }
 
+/* Called with multifd_send_state->mutex held.  Returns false if the
+ * channels can no longer make progress.
+ */
+static bool multifd_send_wait_idle(MultiFDSendParams *p)
+{
+    while (!multifd_send_state->failed && !(p->running && !p->pending_job)) {
+        qemu_cond_wait(&multifd_send_state->cond, &multifd_send_state->mutex);
+    }
+    return !multifd_send_state->failed;
+}
+
+/* Called with multifd_send_state->mutex held */
+static void multifd_send_queue_job(MultiFDSendParams *p, uint32_t flags)
+{
+    p->flags = flags;
+    p->packet_num = multifd_send_state->packet_num++;
+    p->pending_job = true;
+    qemu_sem_post(&p->sem);
+}
+
+/**
+ * multifd_send_pages: hand the collected pages to an idle channel
+ *
+ * Waits until one of the channels is idle, and swaps its (empty) page
+ * array with the one that the migration thread filled.
+ *
+ * Returns 0 for success or -1 if the channels failed.
+ */
+static int multifd_send_pages(void)
+{
+    MultiFDSendParams *p = NULL;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    int count = multifd_send_state->count;
+    int64_t transferred;
+    int i;
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    while (!p) {
+        if (multifd_send_state->failed) {
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            return -1;
+        }
+        for (i = 0; i < count; i++) {
+            MultiFDSendParams *c = &multifd_send_state->params[
+                (multifd_send_state->next_channel + i) % count];
+
+            if (c->running && !c->pending_job) {
+                p = c;
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&multifd_send_state->cond,
+                           &multifd_send_state->mutex);
+        }
+    }
+    multifd_send_state->next_channel = (p->id + 1) % count;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    multifd_send_queue_job(p, 0);
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+
+    transferred = sizeof(MultiFDPacket_t) + pages->used * sizeof(uint64_t);
+    ram_counters.transferred += transferred;
+    qemu_file_update_transfer(ram_state->f, transferred);
+    return 0;
+}
+
+/**
+ * multifd_queue_page: queue a page for sending on the multifd channels
+ *
+ * The page is not copied: the channel thread sends it straight from
+ * guest memory.
+ *
+ * Returns 0 for success or -1 if the channels failed.
+ *
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    /* A packet only describes pages of a single block */
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    pages->niov = multifd_iov_add_page(pages->iov, pages->niov,
+                                       block->host + offset, 1);
+
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    qemu_file_update_transfer(ram_state->f, TARGET_PAGE_SIZE);
+
+    if (pages->used == pages->allocated) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+/**
+ * multifd_send_sync_main: mark a sync point on all the channels
+ *
+ * Flushes the pages collected so far and sends a packet with
+ * MULTIFD_FLAG_SYNC on every channel.  The destination does not go
+ * past the matching RAM_SAVE_FLAG_EOS of the main stream before it
+ * has received everything up to the sync packet on all the channels,
+ * so pages sent on the main stream afterwards cannot be overwritten by
+ * stale multifd data.
+ *
+ * Returns 0 for success or -1 if the channels failed.
+ */
+static int multifd_send_sync_main(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        return -1;
+    }
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (!multifd_send_wait_idle(p)) {
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            return -1;
+        }
+        multifd_send_queue_job(p, MULTIFD_FLAG_SYNC);
+    }
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+
+    return 0;
+}
+
+static int multifd_send_packet(MultiFDSendParams *p, uint32_t flags,
+                               uint64_t packet_num, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(flags);
+    packet->used = cpu_to_be32(pages->used);
+    packet->packet_num = cpu_to_be64(packet_num);
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+    for (i = 0; i < pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+    }
+
+    /* Header and pages leave with a single sendmsg() whenever possible */
+    pages->iov[0].iov_base = packet;
+    pages->iov[0].iov_len = sizeof(*packet) + pages->used * sizeof(uint64_t);
+
+    trace_multifd_send(p->id, packet_num, pages->used, flags);
+    if (multifd_writev_all(p->c, pages->iov, pages->niov, errp) < 0) {
+        return -1;
+    }
+
+    p->num_packets++;
+    p->num_pages += pages->used;
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
+    QIOChannel *c;
+    Error *local_err = NULL;
+
+    c = socket_send_channel_create(&local_err);
+    if (!c) {
+        goto out;
+    }
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    p->c = c;
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+
+    if (multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    p->running = true;
+    qemu_cond_broadcast(&multifd_send_state->cond);
+    qemu_mutex_unlock(&multifd_send_state->mutex);
 
     while (true) {
+        bool pending_job;
+        uint32_t flags;
+        uint64_t packet_num;
+
+        qemu_sem_wait(&p->sem);
+
+        qemu_mutex_lock(&multifd_send_state->mutex);
+        pending_job = p->pending_job;
+        flags = p->flags;
+        packet_num = p->packet_num;
+        qemu_mutex_unlock(&multifd_send_state->mutex);
+
+        /* Queued work is always sent before quitting */
+        if (pending_job) {
+            if (multifd_send_packet(p, flags, packet_num, &local_err) < 0) {
+                break;
+            }
+
+            qemu_mutex_lock(&multifd_send_state->mutex);
+            multifd_pages_reset(p->pages);
+            p->pending_job = false;
+            qemu_cond_broadcast(&multifd_send_state->cond);
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            continue;
+        }
+
         qemu_mutex_lock(&p->mutex);
         if (p->quit) {
             qemu_mutex_unlock(&p->mutex);
             break;
         }
         qemu_mutex_unlock(&p->mutex);
-        qemu_sem_wait(&p->sem);
     }
 
+out:
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    p->running = false;
+    if (local_err) {
+        multifd_send_state->failed = true;
+    }
+    qemu_cond_broadcast(&multifd_send_state->cond);
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+
+    if (local_err) {
+        migrate_set_error(migrate_get_current(), local_err);
+        error_free(local_err);
+    }
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+
     return NULL;
 }
 
 int multifd_save_setup(void)
 {
+    MigrationState *s = migrate_get_current();
     int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
         return 0;
     }
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        Error *local_err = NULL;
+
+        error_setg(&local_err, "multifd is not supported with TLS");
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     multifd_send_state->count = 0;
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    qemu_mutex_init(&multifd_send_state->mutex);
+    qemu_cond_init(&multifd_send_state->cond);
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
@@ -490,6 +1092,9 @@ int multifd_save_setup(void)
         qemu_sem_init(&p->sem, 0);
         p->quit = false;
         p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet = g_malloc0(sizeof(MultiFDPacket_t) +
+                              page_count * sizeof(uint64_t));
         p->name = g_strdup_printf("multifdsend_%d", i);
         qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
                            QEMU_THREAD_JOINABLE);
@@ -503,9 +1108,18 @@ struct MultiFDRecvParams {
     uint8_t id;
     char *name;
     QemuThread thread;
+    QIOChannel *c;
+    /* posted by multifd_recv_sync_main() to resume after a sync point */
     QemuSemaphore sem;
     QemuMutex mutex;
+    bool running;
     bool quit;
+    /* only used by the channel thread */
+    MultiFDPacket_t *packet;
+    uint32_t allocated;
+    struct iovec *iov;
+    uint64_t num_packets;
+    uint64_t num_pages;
 };
 typedef struct MultiFDRecvParams MultiFDRecvParams;
 
@@ -513,18 +1127,27 @@ struct {
     MultiFDRecvParams *params;
     /* number of created threads */
     int count;
+    /* one post per channel that reached a sync point */
+    QemuSemaphore sem_sync;
+    /* set by channel threads that hit an error */
+    bool failed;
 } *multifd_recv_state;
 
 static void terminate_multifd_recv_threads(Error *errp)
 {
     int i;
 
-    for (i = 0; i < multifd_recv_state->count; i++) {
+    for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
+        if (!p->running) {
+            continue;
+        }
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
         qemu_sem_post(&p->sem);
+        /* The thread is most likely waiting for more data */
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         qemu_mutex_unlock(&p->mutex);
     }
 }
@@ -534,19 +1157,30 @@ int multifd_load_cleanup(Error **errp)
     int i;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || !multifd_recv_state) {
         return 0;
     }
     terminate_multifd_recv_threads(NULL);
-    for (i = 0; i < multifd_recv_state->count; i++) {
+    for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
-        qemu_thread_join(&p->thread);
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+            p->c = NULL;
+        }
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         g_free(p->name);
         p->name = NULL;
+        g_free(p->packet);
+        p->packet = NULL;
+        g_free(p->iov);
+        p->iov = NULL;
     }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -555,35 +1189,197 @@ int multifd_load_cleanup(Error **errp)
     return ret;
 }
 
+/**
+ * multifd_recv_sync_main: wait for all channels to reach a sync point
+ *
+ * Called when the main stream reaches RAM_SAVE_FLAG_EOS.  Every channel
+ * stops after its sync packet, so on return all pages that were sent
+ * before the sync point are in guest memory.  The channels are then
+ * released to receive the next round.
+ *
+ * Returns 0 for success or -EIO if a channel failed.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->failed)) {
+        error_report("multifd: a channel failed, aborting the migration");
+        return -EIO;
+    }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            qemu_sem_post(&p->sem);
+        }
+    }
+    trace_multifd_recv_sync_main();
+    return 0;
+}
+
+/**
+ * multifd_recv_packet: receive a packet and its pages
+ *
+ * The pages are read straight into guest memory.
+ *
+ * Returns 1 if a packet was received, 0 on end of file and -1 on error.
+ */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    RAMBlock *block;
+    uint32_t used, i, niov = 0;
+    uint64_t packet_num;
+    int ret;
+
+    ret = qio_channel_read_all_eof(p->c, (char *)packet, sizeof(*packet),
+                                   errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    be32_to_cpus(&packet->magic);
+    if (packet->magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x and expected "
+                   "magic %x", packet->magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    be32_to_cpus(&packet->version);
+    if (packet->version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d and expected "
+                   "version %d", packet->version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    *flags = be32_to_cpu(packet->flags);
+    used = be32_to_cpu(packet->used);
+    packet_num = be64_to_cpu(packet->packet_num);
+    trace_multifd_recv(p->id, packet_num, used, *flags);
+
+    if (used == 0) {
+        return 1;
+    }
+    if (used > MULTIFD_MAX_PAGES) {
+        error_setg(errp, "multifd: received packet with %d pages, at most "
+                   "%d are allowed", used, MULTIFD_MAX_PAGES);
+        return -1;
+    }
+    if (used > p->allocated) {
+        p->packet = g_realloc(p->packet, sizeof(MultiFDPacket_t) +
+                              used * sizeof(uint64_t));
+        p->iov = g_renew(struct iovec, p->iov, used);
+        p->allocated = used;
+        packet = p->packet;
+    }
+
+    if (qio_channel_read_all(p->c, (char *)packet->offset,
+                             used * sizeof(uint64_t), errp) < 0) {
+        return -1;
+    }
+
+    /* Make sure that ramblock is 0 terminated */
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        rcu_read_unlock();
+        error_setg(errp, "multifd: unknown ram block %s", packet->ramblock);
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            offset > block->used_length - TARGET_PAGE_SIZE) {
+            rcu_read_unlock();
+            error_setg(errp, "multifd: offset " RAM_ADDR_FMT " outside "
+                       "block %s of size " RAM_ADDR_FMT, offset,
+                       packet->ramblock, block->used_length);
+            return -1;
+        }
+        niov = multifd_iov_add_page(p->iov, niov, block->host + offset, 0);
+    }
+
+    ret = multifd_readv_all(p->c, p->iov, niov, errp);
+    rcu_read_unlock();
+    if (ret < 0) {
+        return -1;
+    }
+
+    p->num_packets++;
+    p->num_pages += used;
+    return 1;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    bool quit;
+    int ret;
+
+    rcu_register_thread();
 
     while (true) {
+        uint32_t flags = 0;
+
+        ret = multifd_recv_packet(p, &flags, &local_err);
+
         qemu_mutex_lock(&p->mutex);
-        if (p->quit) {
-            qemu_mutex_unlock(&p->mutex);
+        quit = p->quit;
+        qemu_mutex_unlock(&p->mutex);
+        if (ret <= 0 || quit) {
             break;
         }
-        qemu_mutex_unlock(&p->mutex);
-        qemu_sem_wait(&p->sem);
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem);
+        }
     }
 
+    if (ret < 0 && !quit) {
+        atomic_set(&multifd_recv_state->failed, true);
+        error_report_err(local_err);
+    } else {
+        error_free(local_err);
+    }
+    /* Don't leave multifd_recv_sync_main() waiting for us */
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+
+    rcu_unregister_thread();
     return NULL;
 }
 
 int multifd_load_setup(void)
 {
+    MigrationState *s = migrate_get_current();
     int thread_count;
     uint8_t i;
 
     if (!migrate_use_multifd()) {
         return 0;
     }
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_report("multifd is not supported with TLS");
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     multifd_recv_state->count = 0;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -591,14 +1387,108 @@ int multifd_load_setup(void)
         qemu_sem_init(&p->sem, 0);
         p->quit = false;
         p->id = i;
+        p->allocated = migrate_multifd_page_count();
+        p->packet = g_malloc0(sizeof(MultiFDPacket_t) +
+                              p->allocated * sizeof(uint64_t));
+        p->iov = g_new0(struct iovec, p->allocated);
         p->name = g_strdup_printf("multifdrecv_%d", i);
-        qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
-                           QEMU_THREAD_JOINABLE);
-        multifd_recv_state->count++;
     }
     return 0;
 }
 
+bool multifd_recv_all_channels_created(void)
+{
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+    return multifd_recv_state &&
+           multifd_recv_state->count == migrate_multifd_channels();
+}
+
+static void coroutine_fn multifd_recv_channel_co(void *opaque)
+{
+    QIOChannel *ioc = opaque;
+    MultiFDRecvParams *p;
+    Error *local_err = NULL;
+    int id;
+
+    id = multifd_recv_initial_packet(ioc, &local_err);
+    qio_channel_set_blocking(ioc, true, NULL);
+    if (id < 0) {
+        error_report_err(local_err);
+        goto out;
+    }
+    if (!multifd_recv_state) {
+        /* The migration failed while we were waiting for the packet */
+        goto out;
+    }
+
+    p = &multifd_recv_state->params[id];
+    if (p->c) {
+        error_report("multifd: received id '%d' already setup", id);
+        goto out;
+    }
+    p->c = ioc;
+    object_ref(OBJECT(ioc));
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    multifd_recv_state->count++;
+    trace_multifd_recv_new_channel(id);
+
+    if (migration_has_all_channels()) {
+        migration_incoming_process();
+    }
+
+out:
+    object_unref(OBJECT(ioc));
+}
+
+/**
+ * multifd_recv_new_channel: start receiving on an extra migration channel
+ *
+ * The channel identifies itself with its first packet, which is read in
+ * a coroutine so that a slow or silent peer does not block the main loop.
+ * A thread for the channel is started once the packet has arrived, and
+ * the incoming migration starts with the last channel.
+ *
+ * @ioc: channel that was just accepted
+ */
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    Coroutine *co;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: unexpected migration channel");
+        return;
+    }
+
+    object_ref(OBJECT(ioc));
+    qio_channel_set_blocking(ioc, false, NULL);
+    co = qemu_coroutine_create(multifd_recv_channel_co, ioc);
+    qemu_coroutine_enter(co);
+}
+
+/**
+ * ram_save_multifd_page: send a page through the multifd channels
+ *
+ * Returns the number of pages written or -1 on error.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    if (multifd_queue_page(block, offset) < 0) {
+        return -1;
+    }
+    ram_counters.normal++;
+
+    return 1;
+}
+
 /**
  * save_page_header: write page header to wire
  *
@@ -676,8 +1566,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) == 1) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -700,17 +1592,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret == 1) {
+                    xbzrle_counters.cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -719,6 +1615,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         return -1;
     }
 
+    xbzrle_counters.cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -1031,8 +1928,8 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+static int do_compress_ram_page(QEMUFile *f, MigCompressor *comp,
+                                RAMBlock *block, ram_addr_t offset)
 {
     RAMState *rs = ram_state;
     int bytes_sent, blen;
@@ -1040,7 +1937,7 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
 
     bytes_sent = save_page_header(rs, f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
+    blen = qemu_put_compression_data(f, comp, p, TARGET_PAGE_SIZE,
                                      migrate_compress_level());
     if (blen < 0) {
         bytes_sent = 0;
@@ -1171,11 +2068,14 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
                 /* Make sure the first page is sent out before other pages */
                 bytes_xmit = save_page_header(rs, rs->f, block, offset |
                                               RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(rs->f, p, TARGET_PAGE_SIZE,
+                blen = qemu_put_compression_data(rs->f, comp_direct, p,
+                                                 TARGET_PAGE_SIZE,
                                                  migrate_compress_level());
                 if (blen > 0) {
                     ram_counters.transferred += bytes_xmit + blen;
                     ram_counters.normal++;
+                    compression_counters.direct.pages++;
+                    compression_counters.direct.compressed_size += blen;
                     pages = 1;
                 } else {
                     qemu_file_set_error(rs->f, blen);
@@ -1459,6 +2359,14 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         if (migrate_use_compression() &&
             (rs->ram_bulk_stage || !migrate_use_xbzrle())) {
             res = ram_save_compressed_page(rs, pss, last_stage);
+        } else if (migrate_use_multifd()) {
+            ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+
+            /* Zero pages are cheaper to describe on the main stream */
+            res = save_zero_page(rs, pss->block, offset);
+            if (res < 0) {
+                res = ram_save_multifd_page(rs, pss->block, offset);
+            }
         } else {
             res = ram_save_page(rs, pss, last_stage);
         }
@@ -2236,11 +3144,17 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
 
     rcu_read_unlock();
-    compress_threads_save_setup();
+    if (compress_threads_save_setup() < 0) {
+        return -1;
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
+    /* This also waits for the multifd channels to be connected */
+    if (multifd_send_sync_main() < 0) {
+        return -1;
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2317,6 +3231,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
 out:
+    if (multifd_send_sync_main() < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     ram_counters.transferred += 8;
 
@@ -2369,6 +3286,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_unlock();
 
+    if (multifd_send_sync_main() < 0) {
+        return -EIO;
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2504,7 +3424,6 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
     uint8_t *des;
     int len;
 
@@ -2516,14 +3435,13 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
+            /* Decompression will fail in some case, especially when
+             * the page is dirtied while doing the compression, it's
              * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+             * and the failure won't break the data in other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            mig_decompress(param->decomp, des, TARGET_PAGE_SIZE,
+                           param->compbuf, len);
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2573,7 +3491,9 @@ static void compress_threads_load_setup(void)
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf =
+            g_malloc0(mig_compress_bound_any(TARGET_PAGE_SIZE));
+        decomp_param[i].decomp = mig_decompressor_new();
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2601,6 +3521,7 @@ static void compress_threads_load_cleanup(void)
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
+        mig_decompressor_free(decomp_param[i].decomp);
     }
     g_free(decompress_threads);
     g_free(decomp_param);
@@ -2966,7 +3887,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > mig_compress_bound_any(TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2984,6 +3905,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            ret = multifd_recv_sync_main();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
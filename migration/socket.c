@@ -24,8 +24,51 @@
 #include "migration.h"
 #include "qemu-file.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-visit-sockets.h"
 #include "trace.h"
 
+static struct SocketOutgoingArgs {
+    SocketAddress *saddr;
+} outgoing_args;
+
+/**
+ * socket_send_channel_create: open an extra channel to the destination
+ *
+ * Connects synchronously to the address used for the main migration
+ * channel.  Used by the multifd send threads.
+ *
+ * Returns the new channel, or NULL with @errp set.
+ */
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_args.saddr) {
+        error_setg(errp, "multiple migration channels need a tcp: or unix: "
+                   "migration URI");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "multifd-socket-outgoing");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_args.saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+/**
+ * socket_send_channel_destroy: forget the destination address
+ *
+ * Called when the migration is over and no more channels will be created.
+ */
+void socket_send_channel_destroy(void)
+{
+    qapi_free_SocketAddress(outgoing_args.saddr);
+    outgoing_args.saddr = NULL;
+}
 
 static SocketAddress *tcp_build_address(const char *host_port, Error **errp)
 {
@@ -94,6 +137,11 @@ static void socket_start_outgoing_migration(MigrationState *s,
     struct SocketConnectData *data = g_new0(struct SocketConnectData, 1);
 
     data->s = s;
+
+    /* Remember the address in case multifd needs to open more channels */
+    socket_send_channel_destroy();
+    outgoing_args.saddr = QAPI_CLONE(SocketAddress, saddr);
+
     if (saddr->type == SOCKET_ADDRESS_TYPE_INET) {
         data->hostname = g_strdup(saddr->u.inet.host);
     }
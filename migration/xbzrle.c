@@ -12,8 +12,245 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
+/*
+ * Run scanners.  Both return the index of the first byte at or after @i
+ * that ends the current run: for a zero run the first byte that differs
+ * between @old_buf and @new_buf, for a non-zero run the first byte that
+ * is equal.  @slen is returned if the run extends to the end of the page.
+ *
+ * The vectorized variants only speed up the scan, the runs they find
+ * (and therefore the encoded stream) are exactly the same.
+ */
+static int xbzrle_zrun_end_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_int(const uint8_t *old_buf, const uint8_t *new_buf,
+                                int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
+#ifdef CONFIG_AVX2_OPT
+/* As in util/bufferiszero.c, the includes have to be within the
+ * corresponding push_options region, and the regions have to be
+ * ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                                int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq != 0xffffffffu) {
+            return i + ctz32(~eq);
+        }
+        i += 32;
+    }
+    return xbzrle_zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    while (i + 32 <= slen) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+    return xbzrle_nzrun_end_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+
+static int xbzrle_zrun_end_avx512(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    while (i + 64 <= slen) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t ne = _mm512_cmpneq_epi8_mask(o, n);
+
+        if (ne) {
+            return i + ctz64(ne);
+        }
+        i += 64;
+    }
+    return xbzrle_zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_avx512(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int i, int slen)
+{
+    while (i + 64 <= slen) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+        i += 64;
+    }
+    return xbzrle_nzrun_end_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW  1
+#define CACHE_AVX2      2
+
+typedef int (*XBZRLEScanFunc)(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen);
+
+static unsigned cpuid_cache;
+static XBZRLEScanFunc zrun_end = xbzrle_zrun_end_int;
+static XBZRLEScanFunc nzrun_end = xbzrle_nzrun_end_int;
+static const char *accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    zrun_end = xbzrle_zrun_end_int;
+    nzrun_end = xbzrle_nzrun_end_int;
+    accel_name = "int";
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        zrun_end = xbzrle_zrun_end_avx2;
+        nzrun_end = xbzrle_nzrun_end_avx2;
+        accel_name = "avx2";
+    }
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        zrun_end = xbzrle_zrun_end_avx512;
+        nzrun_end = xbzrle_nzrun_end_avx512;
+        accel_name = "avx512bw";
+    }
+#endif
+#endif
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#ifdef CONFIG_AVX512BW_OPT
+            /* ... and that the OS saves the opmask and ZMM state.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested the integer scanner, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *xbzrle_encode_accel_name(void)
+{
+    return accel_name;
+}
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -28,8 +265,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -41,28 +277,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,42 +293,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,7 +311,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
@@ -18,4 +18,10 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/* For tests and benchmarks: switch xbzrle_encode_buffer to the next
+ * less preferred accelerator, returning false when none is left.
+ */
+bool xbzrle_encode_next_accel(void);
+const char *xbzrle_encode_accel_name(void);
 #endif
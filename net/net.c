@@ -408,7 +408,11 @@ void qemu_del_nic(NICState *nic)
     /* If this is a peer NIC and peer has already been deleted, free it now. */
     if (nic->peer_deleted) {
         for (i = 0; i < queues; i++) {
-            qemu_free_net_client(qemu_get_subqueue(nic, i)->peer);
+            NetClientState *peer = qemu_get_subqueue(nic, i)->peer;
+
+            if (peer) {
+                qemu_free_net_client(peer);
+            }
         }
     }
 
@@ -517,6 +521,29 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/* Whether the receive path of @nc may run in an IOThread.  Net filters and
+ * hubs expect the BQL, so backends that use them stay in the main loop.
+ */
+bool qemu_net_supports_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context &&
+           nc->info->type != NET_CLIENT_DRIVER_HUBPORT &&
+           QTAILQ_EMPTY(&nc->filters) &&
+           (!nc->peer || QTAILQ_EMPTY(&nc->peer->filters));
+}
+
+/* Move the backend's event handlers to @ctx, or back to the main loop if
+ * @ctx is NULL.  The peer's receive callbacks are then invoked from @ctx.
+ */
+void qemu_net_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -598,6 +625,8 @@ void qemu_purge_queued_packets(NetClientState *nc)
 static
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_DRIVER_HUBPORT) {
@@ -605,7 +634,16 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+    /* Let the receiver take the backlog as one batch */
+    if (nc->info->receive_batch_begin) {
+        nc->info->receive_batch_begin(nc);
+    }
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    if (nc->info->receive_batch_end) {
+        nc->info->receive_batch_end(nc);
+    }
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -621,6 +659,38 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
+/* Bracket a burst of packets sent by @nc, so that its peer can do the
+ * per-packet bookkeeping (NetQueue flush, guest notification) once for the
+ * whole burst.  The sender must not return to the main loop in between.
+ */
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer) {
+        return;
+    }
+
+    qemu_net_queue_batch_begin(peer->incoming_queue);
+    if (peer->info->receive_batch_begin) {
+        peer->info->receive_batch_begin(peer);
+    }
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    NetClientState *peer = nc->peer;
+
+    if (!peer) {
+        return;
+    }
+
+    qemu_net_queue_batch_end(peer->incoming_queue);
+    if (peer->info->receive_batch_end) {
+        peer->info->receive_batch_end(peer);
+    }
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -947,6 +1017,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1082,6 +1155,9 @@ static void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -23,7 +23,7 @@
 
 #include "qemu/osdep.h"
 #include "net/queue.h"
-#include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,13 +40,35 @@
  * unbounded queueing.
  */
 
+/* Packets wait in a ring of descriptors that grows on demand and is never
+ * freed packet by packet, so a receiver that stays blocked for a while does
+ * not cost an allocation per packet.  A descriptor keeps the iovec array and
+ * payload buffer of its last use for the next packet that lands in it.
+ *
+ * If the sender sets send_nocopy and passes a sent callback, the descriptor
+ * references the sender's buffers, which stay valid until the callback runs.
+ * Otherwise the payload is copied.
+ *
+ * The queue belongs to the context of its receiver, so no locking is needed.
+ */
+
+#define NET_QUEUE_INITIAL_SIZE 64
+
+/* The ring is halved once this many drains of a non-empty ring in a row
+ * used at most a quarter of it, so that a receiver that stalls now and
+ * then keeps its descriptors and their buffers.
+ */
+#define NET_QUEUE_SHRINK_DRAINS 64
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
-    int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    struct iovec *iov;
+    int iovcnt;
+    int iov_max;
+    uint8_t *data;
+    size_t data_max;
 };
 
 struct NetQueue {
@@ -55,11 +77,58 @@ struct NetQueue {
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    /* nq_size is a power of two, nq_head the index of the oldest packet */
+    NetPacket *packets;
+    uint32_t nq_size;
+    uint32_t nq_head;
+
+    /* Most packets queued since the last drain, and the number of drains
+     * in a row that used little of the ring */
+    uint32_t nq_peak;
+    uint32_t idle_drains;
 
     unsigned delivering : 1;
+    unsigned flushing : 1;
+    unsigned flush_pending : 1;
+    unsigned batch;
 };
 
+static NetPacket *qemu_net_queue_entry(NetQueue *queue, uint32_t i)
+{
+    return &queue->packets[(queue->nq_head + i) & (queue->nq_size - 1)];
+}
+
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    g_free(packet->iov);
+    g_free(packet->data);
+}
+
+/* Reallocate the ring with @size descriptors, oldest packet first.  The
+ * queued packets must fit.
+ */
+static void qemu_net_queue_resize(NetQueue *queue, uint32_t size)
+{
+    NetPacket *packets = g_new0(NetPacket, size);
+    uint32_t i;
+
+    assert(queue->nq_count <= size);
+    for (i = 0; i < queue->nq_size; i++) {
+        NetPacket *packet = qemu_net_queue_entry(queue, i);
+
+        if (i < size) {
+            packets[i] = *packet;
+        } else {
+            qemu_net_packet_free(packet);
+        }
+    }
+
+    g_free(queue->packets);
+    queue->packets = packets;
+    queue->nq_size = size;
+    queue->nq_head = 0;
+}
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
@@ -71,7 +140,9 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->nq_count = 0;
     queue->deliver = deliver;
 
-    QTAILQ_INIT(&queue->packets);
+    queue->packets = g_new0(NetPacket, NET_QUEUE_INITIAL_SIZE);
+    queue->nq_size = NET_QUEUE_INITIAL_SIZE;
+    queue->nq_head = 0;
 
     queue->delivering = 0;
 
@@ -80,39 +151,16 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 
 void qemu_del_net_queue(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    uint32_t i;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+    for (i = 0; i < queue->nq_size; i++) {
+        qemu_net_packet_free(&queue->packets[i]);
     }
 
+    g_free(queue->packets);
     g_free(queue);
 }
 
-static void qemu_net_queue_append(NetQueue *queue,
-                                  NetClientState *sender,
-                                  unsigned flags,
-                                  const uint8_t *buf,
-                                  size_t size,
-                                  NetPacketSent *sent_cb)
-{
-    NetPacket *packet;
-
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
-    }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
-
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
-}
-
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
                                unsigned flags,
@@ -121,31 +169,61 @@ void qemu_net_queue_append_iov(NetQueue *queue,
                                NetPacketSent *sent_cb)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t size;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
+    if (queue->nq_count == queue->nq_size) {
+        qemu_net_queue_resize(queue, queue->nq_size * 2);
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_entry(queue, queue->nq_count);
     packet->sender = sender;
-    packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
+    packet->sent_cb = sent_cb;
 
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
+    if (sent_cb && sender->send_nocopy) {
+        if (packet->iov_max < iovcnt) {
+            packet->iov_max = iovcnt;
+            packet->iov = g_renew(struct iovec, packet->iov, iovcnt);
+        }
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+    } else {
+        size = iov_size(iov, iovcnt);
+        if (packet->data_max < size) {
+            packet->data_max = size;
+            packet->data = g_realloc(packet->data, size);
+        }
+        iov_to_buf(iov, iovcnt, 0, packet->data, size);
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+        if (!packet->iov_max) {
+            packet->iov_max = 1;
+            packet->iov = g_new(struct iovec, 1);
+        }
+        packet->iov[0].iov_base = packet->data;
+        packet->iov[0].iov_len = size;
+        packet->iovcnt = 1;
     }
 
     queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->nq_peak = MAX(queue->nq_peak, queue->nq_count);
+}
+
+static void qemu_net_queue_append(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *buf,
+                                  size_t size,
+                                  NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size
+    };
+
+    qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -182,6 +260,32 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+/* Inside a batch, packets left over from earlier are retried once, when
+ * the batch ends, rather than after every packet that gets through.
+ */
+static void qemu_net_queue_flush_or_defer(NetQueue *queue)
+{
+    if (queue->batch) {
+        queue->flush_pending = 1;
+    } else {
+        qemu_net_queue_flush(queue);
+    }
+}
+
+void qemu_net_queue_batch_begin(NetQueue *queue)
+{
+    queue->batch++;
+}
+
+void qemu_net_queue_batch_end(NetQueue *queue)
+{
+    assert(queue->batch);
+    if (--queue->batch == 0 && queue->flush_pending) {
+        queue->flush_pending = 0;
+        qemu_net_queue_flush(queue);
+    }
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -202,7 +306,7 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
         return 0;
     }
 
-    qemu_net_queue_flush(queue);
+    qemu_net_queue_flush_or_defer(queue);
 
     return ret;
 }
@@ -227,53 +331,101 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
         return 0;
     }
 
-    qemu_net_queue_flush(queue);
+    qemu_net_queue_flush_or_defer(queue);
 
     return ret;
 }
 
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
-    NetPacket *packet, *next;
-
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            if (packet->sent_cb) {
-                packet->sent_cb(packet->sender, 0);
-            }
-            g_free(packet);
+    uint32_t first = queue->flushing ? 1 : 0;
+    uint32_t i, j;
+
+    /* The packet being flushed is completed by qemu_net_queue_flush().
+     * Purged packets are only marked here because sent callbacks may queue
+     * more packets.
+     */
+    for (i = first; i < queue->nq_count; i++) {
+        NetPacket *packet = qemu_net_queue_entry(queue, i);
+        NetPacketSent *sent_cb = packet->sent_cb;
+
+        if (packet->sender != from) {
+            continue;
+        }
+
+        packet->sender = NULL;
+        packet->sent_cb = NULL;
+        if (sent_cb) {
+            sent_cb(from, 0);
+        }
+    }
+
+    /* Move the remaining packets together, keeping their order */
+    for (i = j = first; i < queue->nq_count; i++) {
+        NetPacket *packet = qemu_net_queue_entry(queue, i);
+
+        if (!packet->sender) {
+            continue;
+        }
+        if (i != j) {
+            NetPacket tmp = *qemu_net_queue_entry(queue, j);
+
+            *qemu_net_queue_entry(queue, j) = *packet;
+            *packet = tmp;
         }
+        j++;
     }
+    queue->nq_count = j;
 }
 
 bool qemu_net_queue_flush(NetQueue *queue)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
+    if (queue->flushing) {
+        /* Called from a delivery or sent callback; the outer flush goes on
+         * with whatever is queued.
+         */
+        return true;
+    }
 
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
+    queue->flushing = 1;
+    while (queue->nq_count) {
+        NetPacket *packet = qemu_net_queue_entry(queue, 0);
+        NetClientState *sender = packet->sender;
+        NetPacketSent *sent_cb = packet->sent_cb;
+        ssize_t ret = 0;
+
+        /* The packet stays at the head of the ring while it is delivered.
+         * Packets queued meanwhile go to the tail, so no descriptor that
+         * is in use can be reused.
+         */
+        if (sender) {
+            ret = qemu_net_queue_deliver_iov(queue, sender, packet->flags,
+                                             packet->iov, packet->iovcnt);
+            if (ret == 0) {
+                queue->flushing = 0;
+                return false;
+            }
+        }
+
+        queue->nq_head = (queue->nq_head + 1) & (queue->nq_size - 1);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+        if (sent_cb) {
+            sent_cb(sender, ret);
         }
-
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+    }
+    queue->flushing = 0;
+
+    /* Give back what a long stall made the ring grow to, once the ring has
+     * been mostly unused for a while */
+    if (queue->nq_size > NET_QUEUE_INITIAL_SIZE && queue->nq_peak) {
+        if (queue->nq_peak > queue->nq_size / 4) {
+            queue->idle_drains = 0;
+        } else if (++queue->idle_drains >= NET_QUEUE_SHRINK_DRAINS) {
+            qemu_net_queue_resize(queue, queue->nq_size / 2);
+            queue->idle_drains = 0;
         }
-
-        g_free(packet);
     }
+    queue->nq_peak = 0;
     return true;
 }
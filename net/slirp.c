@@ -37,6 +37,7 @@
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "slirp/libslirp.h"
+#include "block/aio.h"
 #include "slirp/ip6.h"
 #include "chardev/char-fe.h"
 #include "sysemu/sysemu.h"
@@ -84,8 +85,26 @@ typedef struct SlirpState {
 #ifndef _WIN32
     gchar *smb_dir;
 #endif
+
+    /* Set while the peer's IOThread polls the stack instead of the main loop */
+    AioContext *ctx;
+    QEMUBH *poll_bh;
+    QEMUTimer *poll_timer;
+    GArray *pollfds;
+    bool pollfds_valid;
+    GHashTable *fd_handlers;
+    unsigned fd_gen;
 } SlirpState;
 
+/* A socket of the stack registered with aio_set_fd_handler() */
+typedef struct SlirpFdHandler {
+    SlirpState *s;
+    int fd;
+    int idx;            /* entry in s->pollfds */
+    int events;         /* G_IO_IN and G_IO_OUT as registered */
+    unsigned gen;
+} SlirpFdHandler;
+
 static struct slirp_config_str *slirp_configs;
 const char *legacy_tftp_prefix;
 const char *legacy_bootp_filename;
@@ -114,15 +133,211 @@ void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
     qemu_send_packet(&s->nc, pkt, pkt_len);
 }
 
+void slirp_output_iov(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    SlirpState *s = opaque;
+
+    qemu_sendv_packet(&s->nc, iov, iovcnt);
+}
+
+void slirp_output_batch_begin(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_net_batch_begin(&s->nc);
+}
+
+void slirp_output_batch_end(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_net_batch_end(&s->nc);
+}
+
+/* Calls into the stack from outside its AioContext must hold the context */
+static void net_slirp_lock(SlirpState *s)
+{
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+    }
+}
+
+static void net_slirp_unlock(SlirpState *s)
+{
+    if (s->ctx) {
+        aio_context_release(s->ctx);
+    }
+}
+
+/* Sockets may have been added or freed, so poll them again */
+static void net_slirp_kick(SlirpState *s)
+{
+    if (s->ctx) {
+        qemu_bh_schedule(s->poll_bh);
+    }
+}
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
+    net_slirp_lock(s);
     slirp_input(s->slirp, buf, size);
+    net_slirp_kick(s);
+    net_slirp_unlock(s);
 
     return size;
 }
 
+static void net_slirp_fd_event(SlirpFdHandler *h, int revents)
+{
+    SlirpState *s = h->s;
+
+    g_array_index(s->pollfds, GPollFD, h->idx).revents |= revents;
+    qemu_bh_schedule(s->poll_bh);
+}
+
+static void net_slirp_fd_read(void *opaque)
+{
+    net_slirp_fd_event(opaque, G_IO_IN);
+}
+
+static void net_slirp_fd_write(void *opaque)
+{
+    net_slirp_fd_event(opaque, G_IO_OUT);
+}
+
+static void net_slirp_fd_handler_free(gpointer data)
+{
+    SlirpFdHandler *h = data;
+
+    aio_set_fd_handler(h->s->ctx, h->fd, false, NULL, NULL, NULL, NULL);
+    g_free(h);
+}
+
+static gboolean net_slirp_fd_handler_stale(gpointer key, gpointer value,
+                                           gpointer opaque)
+{
+    SlirpFdHandler *h = value;
+    SlirpState *s = opaque;
+
+    return h->gen != s->fd_gen;
+}
+
+/*
+ * Register a handler for each socket in s->pollfds and drop the ones of
+ * sockets that slirp no longer polls.  AioContext handlers cannot wait for
+ * G_IO_PRI; slirp sets SO_OOBINLINE, so urgent data is read with the rest.
+ */
+static void net_slirp_update_fd_handlers(SlirpState *s)
+{
+    int i;
+
+    s->fd_gen++;
+    for (i = 0; i < s->pollfds->len; i++) {
+        GPollFD *pfd = &g_array_index(s->pollfds, GPollFD, i);
+        int events = pfd->events & (G_IO_IN | G_IO_OUT);
+        SlirpFdHandler *h;
+
+        h = g_hash_table_lookup(s->fd_handlers, GINT_TO_POINTER(pfd->fd));
+        if (!h) {
+            h = g_new0(SlirpFdHandler, 1);
+            h->s = s;
+            h->fd = pfd->fd;
+            g_hash_table_insert(s->fd_handlers, GINT_TO_POINTER(h->fd), h);
+        }
+        h->idx = i;
+        h->gen = s->fd_gen;
+        if (h->events != events) {
+            h->events = events;
+            aio_set_fd_handler(s->ctx, h->fd, false,
+                               events & G_IO_IN ? net_slirp_fd_read : NULL,
+                               events & G_IO_OUT ? net_slirp_fd_write : NULL,
+                               NULL, h);
+        }
+    }
+    g_hash_table_foreach_remove(s->fd_handlers, net_slirp_fd_handler_stale, s);
+}
+
+/*
+ * The IOThread's equivalent of main_loop_wait() for one stack: handle what
+ * the fd handlers and the timer saw, then poll the sockets again.
+ */
+static void net_slirp_poll_bh(void *opaque)
+{
+    SlirpState *s = opaque;
+    uint32_t timeout = UINT32_MAX;
+
+    aio_context_acquire(s->ctx);
+    if (s->pollfds_valid) {
+        slirp_instance_pollfds_poll(s->slirp, s->pollfds, 0);
+    }
+    g_array_set_size(s->pollfds, 0);
+    slirp_instance_pollfds_fill(s->slirp, s->pollfds, &timeout);
+    s->pollfds_valid = true;
+    net_slirp_update_fd_handlers(s);
+
+    if (timeout == UINT32_MAX) {
+        timer_del(s->poll_timer);
+    } else {
+        timer_mod(s->poll_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + timeout);
+    }
+    aio_context_release(s->ctx);
+}
+
+static void net_slirp_poll_timer(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_bh_schedule(s->poll_bh);
+}
+
+static void net_slirp_detach_aio_context(SlirpState *s)
+{
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    g_hash_table_remove_all(s->fd_handlers);
+    timer_del(s->poll_timer);
+    timer_free(s->poll_timer);
+    s->poll_timer = NULL;
+    qemu_bh_delete(s->poll_bh);
+    s->poll_bh = NULL;
+    s->pollfds_valid = false;
+    slirp_set_aio_context(s->slirp, NULL);
+    s->ctx = NULL;
+    aio_context_release(ctx);
+}
+
+static void net_slirp_attach_aio_context(SlirpState *s, AioContext *ctx)
+{
+    aio_context_acquire(ctx);
+    s->ctx = ctx;
+    s->poll_bh = aio_bh_new(ctx, net_slirp_poll_bh, s);
+    s->poll_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                  net_slirp_poll_timer, s);
+    slirp_set_aio_context(s->slirp, ctx);
+    qemu_bh_schedule(s->poll_bh);
+    aio_context_release(ctx);
+}
+
+static void net_slirp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    if (s->ctx) {
+        net_slirp_detach_aio_context(s);
+    }
+    if (ctx) {
+        net_slirp_attach_aio_context(s, ctx);
+    }
+}
+
 static void slirp_smb_exit(Notifier *n, void *data)
 {
     SlirpState *s = container_of(n, SlirpState, exit_notifier);
@@ -133,6 +348,11 @@ static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
+    if (s->ctx) {
+        net_slirp_detach_aio_context(s);
+    }
+    g_hash_table_destroy(s->fd_handlers);
+    g_array_free(s->pollfds, true);
     slirp_cleanup(s->slirp);
     if (s->exit_notifier.notify) {
         qemu_remove_exit_notifier(&s->exit_notifier);
@@ -146,6 +366,7 @@ static NetClientInfo net_slirp_info = {
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
     .cleanup = net_slirp_cleanup,
+    .set_aio_context = net_slirp_set_aio_context,
 };
 
 static int net_slirp_init(NetClientState *peer, const char *model,
@@ -372,6 +593,9 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           ipv6, ip6_prefix, vprefix6_len, ip6_host,
                           vhostname, tftp_export, bootfile, dhcp,
                           dns, ip6_dns, dnssearch, s);
+    s->pollfds = g_array_new(false, false, sizeof(GPollFD));
+    s->fd_handlers = g_hash_table_new_full(NULL, NULL, NULL,
+                                           net_slirp_fd_handler_free);
     QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
 
     for (config = slirp_configs; config; config = config->next) {
@@ -488,7 +712,10 @@ void hmp_hostfwd_remove(Monitor *mon, const QDict *qdict)
 
     host_port = atoi(p);
 
+    net_slirp_lock(s);
     err = slirp_remove_hostfwd(s->slirp, is_udp, host_addr, host_port);
+    net_slirp_kick(s);
+    net_slirp_unlock(s);
 
     monitor_printf(mon, "host forwarding rule for %s %s\n", src_str,
                    err ? "not found" : "removed");
@@ -594,7 +821,13 @@ void hmp_hostfwd_add(Monitor *mon, const QDict *qdict)
     }
     if (s) {
         Error *err = NULL;
-        if (slirp_hostfwd(s, redir_str, 0, &err) < 0) {
+        int ret;
+
+        net_slirp_lock(s);
+        ret = slirp_hostfwd(s, redir_str, 0, &err);
+        net_slirp_kick(s);
+        net_slirp_unlock(s);
+        if (ret < 0) {
             error_report_err(err);
         }
     }
@@ -766,19 +999,28 @@ struct GuestFwd {
     CharBackend hd;
     struct in_addr server;
     int port;
-    Slirp *slirp;
+    SlirpState *s;
 };
 
 static int guestfwd_can_read(void *opaque)
 {
     struct GuestFwd *fwd = opaque;
-    return slirp_socket_can_recv(fwd->slirp, fwd->server, fwd->port);
+    int ret;
+
+    net_slirp_lock(fwd->s);
+    ret = slirp_socket_can_recv(fwd->s->slirp, fwd->server, fwd->port);
+    net_slirp_unlock(fwd->s);
+    return ret;
 }
 
 static void guestfwd_read(void *opaque, const uint8_t *buf, int size)
 {
     struct GuestFwd *fwd = opaque;
-    slirp_socket_recv(fwd->slirp, fwd->server, fwd->port, buf, size);
+
+    net_slirp_lock(fwd->s);
+    slirp_socket_recv(fwd->s->slirp, fwd->server, fwd->port, buf, size);
+    net_slirp_kick(fwd->s);
+    net_slirp_unlock(fwd->s);
 }
 
 static int slirp_guestfwd(SlirpState *s, const char *config_str,
@@ -852,7 +1094,7 @@ static int slirp_guestfwd(SlirpState *s, const char *config_str,
         }
         fwd->server = server;
         fwd->port = port;
-        fwd->slirp = s->slirp;
+        fwd->s = s;
 
         qemu_chr_fe_set_handlers(&fwd->hd, guestfwd_can_read, guestfwd_read,
                                  NULL, NULL, fwd, NULL, true);
@@ -874,7 +1116,9 @@ void hmp_info_usernet(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "VLAN %d (%s):\n",
                        got_vlan_id ? id : -1,
                        s->nc.name);
+        net_slirp_lock(s);
         slirp_connection_info(s->slirp, mon);
+        net_slirp_unlock(s);
     }
 }
 
@@ -40,11 +40,16 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Default and maximum number of packets read per tap_send() callback */
+#define TAP_DEFAULT_BATCH_SIZE 50
+#define TAP_MAX_BATCH_SIZE     1024
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -58,6 +63,8 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    unsigned batch_size;
+    AioContext *ctx;
     Notifier exit;
 } TAPState;
 
@@ -69,10 +76,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, fd_read, fd_write, NULL, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -183,8 +194,10 @@ static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
-    int packets = 0;
+    unsigned packets = 0;
 
+    /* The peer flushes its queue and notifies the guest once per batch */
+    qemu_net_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -213,10 +226,11 @@ static void tap_send(void *opaque)
          * stalling the guest.
          */
         packets++;
-        if (packets >= 50) {
+        if (packets >= s->batch_size) {
             break;
         }
     }
+    qemu_net_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -282,6 +296,26 @@ static int tap_set_vnet_be(NetClientState *nc, bool is_be)
     return tap_fd_set_vnet_be(s->fd, is_be);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+
+    if (s->ctx == ctx || s->fd < 0) {
+        return;
+    }
+
+    /* Unregister from the old context before serving the fd elsewhere */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 static void tap_set_offload(NetClientState *nc, int csum, int tso4,
                      int tso6, int ecn, int ufo)
 {
@@ -359,6 +393,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -379,6 +414,9 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s->using_vnet_hdr = false;
     s->has_ufo = tap_probe_has_ufo(s->fd);
     s->enabled = true;
+    s->batch_size = TAP_DEFAULT_BATCH_SIZE;
+    /* tap_send() stops reading into s->buf until tap_send_completed() */
+    nc->send_nocopy = 1;
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     /*
      * Make sure host header length is set correctly in tap:
@@ -654,6 +692,10 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+    if (tap->has_batch_size) {
+        s->batch_size = tap->batch_size;
+    }
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
@@ -766,6 +808,13 @@ int net_init_tap(const Netdev *netdev, const char *name,
     queues = tap->has_queues ? tap->queues : 1;
     vhostfdname = tap->has_vhostfd ? tap->vhostfd : NULL;
 
+    if (tap->has_batch_size &&
+        (tap->batch_size < 1 || tap->batch_size > TAP_MAX_BATCH_SIZE)) {
+        error_setg(errp, "batch-size must be between 1 and %d",
+                   TAP_MAX_BATCH_SIZE);
+        return -1;
+    }
+
     /* QEMU vlans does not support multiqueue tap, in this case peer is set.
      * For -netdev, peer is always NULL. */
     if (peer && (tap->has_queues || tap->has_fds || tap->has_vhostfds)) {
@@ -37,6 +37,7 @@
 #include "qemu/option.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/timer.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
@@ -66,6 +67,8 @@ enum {
     OPTION_SIZE = 264,
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
+    OPTION_MAX_INFLIGHT = 267,
+    OPTION_STATS = 268,
 };
 
 typedef enum OutputFormat {
@@ -179,6 +182,9 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--max-inflight' limits the amount of data that has been read but not\n"
+           "       yet written (defaults to two buffers per coroutine)\n"
+           "  '--stats' prints read and write throughput once the conversion is done\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1528,6 +1534,25 @@ enum ImgConvertBlockStatus {
 
 #define MAX_COROUTINES 16
 
+/* A range of the source that has been claimed by a read coroutine and is
+ * waiting for (or undergoing) its write.  Data chunks carry a buffer from
+ * the pool, zero and backing file chunks do not. */
+typedef struct ImgConvertChunk {
+    int64_t sector_num;
+    int nb_sectors;
+    enum ImgConvertBlockStatus status;
+    uint8_t *buf;
+    int64_t cost;
+    QTAILQ_ENTRY(ImgConvertChunk) next;
+} ImgConvertChunk;
+
+typedef struct ImgConvertStage {
+    int64_t bytes;
+    int64_t busy_ns;
+    int64_t busy_since;
+    int in_flight;
+} ImgConvertStage;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1544,15 +1569,30 @@ typedef struct ImgConvertState {
     bool compressed;
     bool target_has_backing;
     bool wr_in_order;
+    bool show_stats;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
     int running_coroutines;
-    Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
+    int running_readers;
+    bool reads_done;
     CoMutex lock;
     int ret;
+
+    /* Bytes of chunks between read and write completion */
+    int64_t max_inflight;
+    int64_t inflight;
+    int64_t peak_inflight;
+    CoQueue budget_queue;
+    CoQueue write_queue;
+    QTAILQ_HEAD(, ImgConvertChunk) ready_chunks;
+    QTAILQ_HEAD(, ImgConvertChunk) free_chunks;
+
+    ImgConvertStage read_stage;
+    ImgConvertStage write_stage;
+    int64_t start_ns;
+    int64_t end_ns;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1737,28 +1777,112 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
-static void coroutine_fn convert_co_do_copy(void *opaque)
+static void convert_stage_begin(ImgConvertStage *stage)
 {
-    ImgConvertState *s = opaque;
-    uint8_t *buf = NULL;
-    int ret, i;
-    int index = -1;
+    if (stage->in_flight++ == 0) {
+        stage->busy_since = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+}
 
-    for (i = 0; i < s->num_coroutines; i++) {
-        if (s->co[i] == qemu_coroutine_self()) {
-            index = i;
-            break;
+static void convert_stage_end(ImgConvertStage *stage, int64_t bytes)
+{
+    stage->bytes += bytes;
+    if (--stage->in_flight == 0) {
+        stage->busy_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                          stage->busy_since;
+    }
+}
+
+static void coroutine_fn convert_co_fail(ImgConvertState *s, int ret)
+{
+    if (s->ret == -EINPROGRESS) {
+        s->ret = ret;
+    }
+    qemu_co_queue_restart_all(&s->budget_queue);
+    qemu_co_queue_restart_all(&s->write_queue);
+}
+
+/*
+ * Take a chunk descriptor from the pool and charge it against the in-flight
+ * budget, waiting for writes to retire earlier chunks if necessary.  A data
+ * chunk costs its buffer; other chunks cost only the descriptor.  Must be
+ * called with s->lock held, so that the budget is granted in sector order;
+ * otherwise an in-order writer could wait forever for a chunk whose reader
+ * is itself waiting for budget.
+ *
+ * Returns NULL if the conversion failed while waiting.
+ */
+static ImgConvertChunk *coroutine_fn convert_chunk_get(ImgConvertState *s,
+                                                       bool need_buf)
+{
+    ImgConvertChunk *chunk;
+    int64_t buf_size = s->buf_sectors * BDRV_SECTOR_SIZE;
+    int64_t cost = need_buf ? buf_size : sizeof(*chunk);
+
+    /* Always let one chunk through, whatever the budget */
+    while (s->inflight && s->inflight + cost > s->max_inflight) {
+        if (s->ret != -EINPROGRESS) {
+            return NULL;
         }
+        qemu_co_queue_wait(&s->budget_queue, NULL);
+    }
+    if (s->ret != -EINPROGRESS) {
+        return NULL;
+    }
+
+    chunk = QTAILQ_FIRST(&s->free_chunks);
+    if (chunk) {
+        QTAILQ_REMOVE(&s->free_chunks, chunk, next);
+    } else {
+        chunk = g_new0(ImgConvertChunk, 1);
     }
-    assert(index >= 0);
+    if (need_buf && !chunk->buf) {
+        chunk->buf = blk_blockalign(s->target, buf_size);
+    }
+    chunk->cost = cost;
+    s->inflight += cost;
+    s->peak_inflight = MAX(s->peak_inflight, s->inflight);
+    return chunk;
+}
+
+static void coroutine_fn convert_chunk_put(ImgConvertState *s,
+                                           ImgConvertChunk *chunk)
+{
+    s->inflight -= chunk->cost;
+    /* Chunks with buffers go first so that they are reused first */
+    if (chunk->buf) {
+        QTAILQ_INSERT_HEAD(&s->free_chunks, chunk, next);
+    } else {
+        QTAILQ_INSERT_TAIL(&s->free_chunks, chunk, next);
+    }
+    qemu_co_queue_next(&s->budget_queue);
+}
+
+static void convert_co_exit(ImgConvertState *s)
+{
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
 
-    s->running_coroutines++;
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+/*
+ * Read stage: claim the next range of the source, read it into a pooled
+ * buffer and hand it over to the write stage.  Reads run ahead of the
+ * writes for as long as the in-flight budget allows.
+ */
+static void coroutine_fn convert_co_read_chunks(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    int ret;
 
     while (1) {
+        ImgConvertChunk *chunk;
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
+        bool need_buf;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1768,7 +1892,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         n = convert_iteration_sectors(s, s->sector_num);
         if (n < 0) {
             qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
+            convert_co_fail(s, n);
             break;
         }
         /* save current sector and allocation status to local variables */
@@ -1777,78 +1901,156 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         if (!s->min_sparse && s->status == BLK_ZERO) {
             n = MIN(n, s->buf_sectors);
         }
+        need_buf = status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO);
+        chunk = convert_chunk_get(s, need_buf);
+        if (!chunk) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
         /* increment global sector counter so that other coroutines can
          * already continue reading beyond this request */
         s->sector_num += n;
         qemu_co_mutex_unlock(&s->lock);
 
-        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
-            s->allocated_done += n;
-            qemu_progress_print(100.0 * s->allocated_done /
-                                        s->allocated_sectors, 0);
-        }
-
         if (status == BLK_DATA) {
-            ret = convert_co_read(s, sector_num, n, buf);
+            convert_stage_begin(&s->read_stage);
+            ret = convert_co_read(s, sector_num, n, chunk->buf);
+            convert_stage_end(&s->read_stage, ret < 0 ? 0 :
+                              (int64_t)n * BDRV_SECTOR_SIZE);
             if (ret < 0) {
                 error_report("error while reading sector %" PRId64
                              ": %s", sector_num, strerror(-ret));
-                s->ret = ret;
+                convert_chunk_put(s, chunk);
+                convert_co_fail(s, ret);
+                break;
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
-            memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
+            memset(chunk->buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
 
-        if (s->wr_in_order) {
-            /* keep writes in order */
-            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
-                s->wait_sector_num[index] = sector_num;
-                qemu_coroutine_yield();
-            }
-            s->wait_sector_num[index] = -1;
+        chunk->sector_num = sector_num;
+        chunk->nb_sectors = n;
+        chunk->status = status;
+        QTAILQ_INSERT_TAIL(&s->ready_chunks, chunk, next);
+        qemu_co_queue_next(&s->write_queue);
+    }
+
+    if (--s->running_readers == 0) {
+        s->reads_done = true;
+        qemu_co_queue_restart_all(&s->write_queue);
+    }
+    convert_co_exit(s);
+}
+
+static ImgConvertChunk *convert_next_ready_chunk(ImgConvertState *s)
+{
+    ImgConvertChunk *chunk;
+
+    if (!s->wr_in_order) {
+        return QTAILQ_FIRST(&s->ready_chunks);
+    }
+    QTAILQ_FOREACH(chunk, &s->ready_chunks, next) {
+        if (chunk->sector_num == s->wr_offs) {
+            return chunk;
         }
+    }
+    return NULL;
+}
 
-        if (s->ret == -EINPROGRESS) {
-            ret = convert_co_write(s, sector_num, n, buf, status);
-            if (ret < 0) {
-                error_report("error while writing sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                s->ret = ret;
+/*
+ * Write stage: write out chunks as they become ready, in any order unless
+ * s->wr_in_order is set, and return their buffers to the pool.
+ */
+static void coroutine_fn convert_co_write_chunks(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    int ret;
+
+    while (s->ret == -EINPROGRESS) {
+        ImgConvertChunk *chunk = convert_next_ready_chunk(s);
+        int64_t bytes;
+
+        if (!chunk) {
+            if (s->reads_done) {
+                assert(QTAILQ_EMPTY(&s->ready_chunks));
+                break;
             }
+            qemu_co_queue_wait(&s->write_queue, NULL);
+            continue;
         }
+        QTAILQ_REMOVE(&s->ready_chunks, chunk, next);
 
+        bytes = chunk->status == BLK_DATA
+              ? (int64_t)chunk->nb_sectors * BDRV_SECTOR_SIZE : 0;
+        convert_stage_begin(&s->write_stage);
+        ret = convert_co_write(s, chunk->sector_num, chunk->nb_sectors,
+                               chunk->buf, chunk->status);
+        convert_stage_end(&s->write_stage, ret < 0 ? 0 : bytes);
         if (s->wr_in_order) {
-            /* reenter the coroutine that might have waited
-             * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
-            }
+            s->wr_offs = chunk->sector_num + chunk->nb_sectors;
+        }
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", chunk->sector_num, strerror(-ret));
+            convert_chunk_put(s, chunk);
+            convert_co_fail(s, ret);
+            break;
+        }
+        /* Progress counts data that is on the target, not data that is
+         * only buffered by the read-ahead */
+        if (chunk->status == BLK_DATA) {
+            s->allocated_done += chunk->nb_sectors;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
         }
+        convert_chunk_put(s, chunk);
     }
 
-    qemu_vfree(buf);
-    s->co[index] = NULL;
-    s->running_coroutines--;
-    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
-        /* the convert job finished successfully */
-        s->ret = 0;
+    convert_co_exit(s);
+}
+
+static void convert_free_chunks(ImgConvertState *s)
+{
+    ImgConvertChunk *chunk, *next_chunk;
+
+    QTAILQ_CONCAT(&s->free_chunks, &s->ready_chunks);
+    QTAILQ_FOREACH_SAFE(chunk, &s->free_chunks, next, next_chunk) {
+        QTAILQ_REMOVE(&s->free_chunks, chunk, next);
+        qemu_vfree(chunk->buf);
+        g_free(chunk);
     }
 }
 
+static void convert_print_stage(const char *name, ImgConvertStage *stage)
+{
+    double mib = (double)stage->bytes / M_BYTE;
+    double secs = stage->busy_ns / 1e9;
+
+    printf("%-6s %12.2f MiB in %9.3f s busy (%.2f MiB/s)\n",
+           name, mib, secs, secs > 0 ? mib / secs : 0.0);
+}
+
+static void convert_print_stats(ImgConvertState *s)
+{
+    double mib = (double)s->total_sectors * BDRV_SECTOR_SIZE / M_BYTE;
+    double secs = (s->end_ns - s->start_ns) / 1e9;
+
+    printf("Pipeline statistics:\n");
+    convert_print_stage("read:", &s->read_stage);
+    convert_print_stage("write:", &s->write_stage);
+    printf("%-6s %12.2f MiB in %9.3f s      (%.2f MiB/s)\n",
+           "total:", mib, secs, secs > 0 ? mib / secs : 0.0);
+    printf("Peak in-flight: %.2f MiB of %.2f MiB\n",
+           (double)s->peak_inflight / M_BYTE,
+           (double)s->max_inflight / M_BYTE);
+}
+
 static int convert_do_copy(ImgConvertState *s)
 {
-    int ret, i, n;
+    int ret, i, n, nb_writers;
     int64_t sector_num = 0;
+    Coroutine *co;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1890,16 +2092,45 @@ static int convert_do_copy(ImgConvertState *s)
     s->sector_next_status = 0;
     s->ret = -EINPROGRESS;
 
+    /* Default to enough read-ahead to keep every coroutine busy while the
+     * writes of the previous round complete */
+    if (!s->max_inflight) {
+        s->max_inflight = 2 * s->num_coroutines *
+                          s->buf_sectors * BDRV_SECTOR_SIZE;
+    }
+    s->max_inflight = MAX(s->max_inflight, s->buf_sectors * BDRV_SECTOR_SIZE);
+
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->budget_queue);
+    qemu_co_queue_init(&s->write_queue);
+    QTAILQ_INIT(&s->ready_chunks);
+    QTAILQ_INIT(&s->free_chunks);
+
+    /* Only one writer when writes must be in order; anything more would
+     * just queue up behind it */
+    nb_writers = s->wr_in_order ? 1 : s->num_coroutines;
+    s->running_readers = s->num_coroutines;
+    s->running_coroutines = s->num_coroutines + nb_writers;
+    s->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < nb_writers; i++) {
+        co = qemu_coroutine_create(convert_co_write_chunks, s);
+        qemu_coroutine_enter(co);
+    }
     for (i = 0; i < s->num_coroutines; i++) {
-        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
-        qemu_coroutine_enter(s->co[i]);
+        co = qemu_coroutine_create(convert_co_read_chunks, s);
+        qemu_coroutine_enter(co);
     }
 
     while (s->running_coroutines) {
         main_loop_wait(false);
     }
+    s->end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    assert(!s->inflight || s->ret);
+    convert_free_chunks(s);
+
+    if (s->show_stats && !s->ret) {
+        convert_print_stats(s);
+    }
 
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
@@ -1945,6 +2176,8 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"force-share", no_argument, 0, 'U'},
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
+            {"max-inflight", required_argument, 0, OPTION_MAX_INFLIGHT},
+            {"stats", no_argument, 0, OPTION_STATS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:co:s:l:S:pt:T:qnm:WU",
@@ -2060,6 +2293,22 @@ static int img_convert(int argc, char **argv)
         case OPTION_TARGET_IMAGE_OPTS:
             tgt_image_opts = true;
             break;
+        case OPTION_MAX_INFLIGHT:
+        {
+            int64_t sval;
+
+            sval = cvtnum(optarg);
+            if (sval <= 0) {
+                error_report("Invalid in-flight buffer limit specified");
+                goto fail_getopt;
+            }
+
+            s.max_inflight = sval;
+            break;
+        }
+        case OPTION_STATS:
+            s.show_stats = true;
+            break;
         }
     }
 
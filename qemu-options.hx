@@ -128,9 +128,10 @@ Select CPU model (@code{-cpu help} for list and additional feature selection)
 ETEXI
 
 DEF("accel", HAS_ARG, QEMU_OPTION_accel,
-    "-accel [accel=]accelerator[,thread=single|multi]\n"
+    "-accel [accel=]accelerator[,thread=single|multi][,superblocks=on|off]\n"
     "                select accelerator (kvm, xen, hax, hvf, whpx or tcg; use 'help' for a list)\n"
-    "                thread=single|multi (enable multi-threaded TCG)", QEMU_ARCH_ALL)
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                superblocks=on|off (retranslate hot TCG code paths as superblocks)", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
 @findex -accel
@@ -144,6 +145,15 @@ Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
 is to enable multi-threading where both the back-end and front-ends support it and
 no incompatible TCG features have been enabled (e.g. icount/replay).
+@item superblocks=on|off
+Count how often each translated block runs, and retranslate blocks that
+become hot as superblocks: the translation goes on along the most executed
+path past forward direct jumps and conditional branches, leaving through side
+exits when the guest takes another path. A branch back to the start of a
+superblock loops within it. Guest registers can then stay in host registers
+past conditional branches on the hot path; the TCG optimizer still works on
+one basic block at a time. Only some targets (currently x86) support it, and
+it has no effect with icount. The default is off.
 @end table
 ETEXI
 
@@ -807,7 +817,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -879,7 +889,8 @@ unsafe       │ on                off            on
 The default mode is @option{cache=writeback}.
 
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread
+based disk I/O, native Linux AIO and Linux io_uring.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specify format=raw to avoid interpreting
@@ -1921,7 +1932,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,batch-size=n]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -1944,6 +1955,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to speciy the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use 'batch-size=n' to read at most n packets (default 50) per wakeup\n"
+    "                and notify the guest once per batch\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -1998,6 +2011,17 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "                attach to the existing network interface 'name' with AF_XDP socket\n"
+    "                use 'mode=MODE' to specify an XDP program attach mode\n"
+    "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
+    "                use 'queues=n' to specify how many device queues to use (default: 1)\n"
+    "                use 'start-queue=m' to use device queues starting from m (default: 0)\n"
+    "                use 'inhibit=on|off' to not load the default XDP program (default: off)\n"
+    "                use 'sock-fds=x:y:...:z' to provide file descriptors for already open AF_XDP sockets\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2018,6 +2042,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2252,6 +2279,12 @@ and the default bridge device is @file{br0}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{batch-size}=@var{n} bounds the number of packets read from the TAP
+interface each time it becomes readable (default 50).  Packets read in one
+go are handed to the guest NIC as a batch, which lets virtio-net notify the
+guest once per batch instead of once per packet.  Larger values raise the
+packet rate at the cost of holding the global lock for longer.
+
 Examples:
 
 @example
@@ -2449,6 +2482,32 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}][,inhibit=on|off][,sock-fds=@var{x}:@var{y}:...:@var{z}]
+Attach to the existing network interface @var{name} through AF_XDP sockets,
+one per queue.  Packets are exchanged with the kernel through a shared UMEM
+area, bypassing the host network stack.  Interface queues @var{m} to
+@var{m}+@var{n}-1 are used, and each of them backs one virtio-net queue pair
+when the guest NIC is created with the same number of queues.  Traffic
+reaching other queues of the interface is not seen by the guest, so the NIC
+usually needs to be set up (e.g. with @code{ethtool -L}) to use exactly
+these queues.
+
+Unless @option{inhibit=on} is given, QEMU loads the default XDP program,
+which needs CAP_NET_ADMIN and CAP_SYS_ADMIN.  With @option{inhibit=on},
+another process loads the program and passes the already created sockets
+through @option{sock-fds}.  This option is only available if QEMU has been
+compiled with libxdp.
+
+Example:
+@example
+ip link add dev veth0 type veth peer name veth1
+ip link set dev veth0 up
+ip link set dev veth1 up
+qemu-system-x86_64 linux.img \
+        -netdev af-xdp,id=net0,ifname=veth1 \
+        -device virtio-net-pci,netdev=net0
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}[,netdev=@var{nd}]
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -2477,7 +2536,7 @@ qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,sha
      -device virtio-net-pci,netdev=net0
 @end example
 
-@item --nic [tap|bridge|user|l2tpv3|vde|netmap|vhost-user|socket][,...][,mac=macaddr]
+@item --nic [tap|bridge|user|l2tpv3|vde|netmap|af-xdp|vhost-user|socket][,...][,mac=macaddr]
 
 This option is a shortcut for setting both, the on-board (default) guest NIC
 hardware and the host network backend in one go. The host backend options are
@@ -39,7 +39,8 @@
  * This routine is very heavily used in the network
  * code and should be modified for each CPU to be as fast as possible.
  *
- * XXX Since we will never span more than 1 mbuf, we can optimise this
+ * The data is the mbuf's own m_len bytes, followed by its payload in
+ * the socket buffer if M_SBUF is set.
  */
 
 #define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
@@ -52,6 +53,8 @@ int cksum(struct mbuf *m, int len)
 	register int sum = 0;
 	register int mlen = 0;
 	int byte_swapped = 0;
+	struct iovec iov[3];
+	int i, iovcnt = 1;
 
 	union {
 		uint8_t  c[2];
@@ -62,66 +65,86 @@ int cksum(struct mbuf *m, int len)
 		uint32_t l;
 	} l_util;
 
-	if (m->m_len == 0)
-	   goto cont;
-	w = mtod(m, uint16_t *);
-
-	mlen = m->m_len;
-
-	if (len < mlen)
-	   mlen = len;
-#ifdef DEBUG
-	len -= mlen;
-#endif
-	/*
-	 * Force to even boundary.
-	 */
-	if ((1 & (uintptr_t)w) && (mlen > 0)) {
-		REDUCE;
-		sum <<= 8;
-		s_util.c[0] = *(uint8_t *)w;
-		w = (uint16_t *)((int8_t *)w + 1);
-		mlen--;
-		byte_swapped = 1;
-	}
-	/*
-	 * Unroll the loop to make overhead from
-	 * branches &c small.
-	 */
-	while ((mlen -= 32) >= 0) {
-		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-		sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-		sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-		sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-		w += 16;
-	}
-	mlen += 32;
-	while ((mlen -= 8) >= 0) {
-		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-		w += 4;
-	}
-	mlen += 8;
-	if (mlen == 0 && byte_swapped == 0)
-	   goto cont;
-	REDUCE;
-	while ((mlen -= 2) >= 0) {
-		sum += *w++;
+	iov[0].iov_base = m->m_data;
+	iov[0].iov_len = m->m_len;
+	if (m->m_flags & M_SBUF) {
+		iovcnt += m_sbuf_iov(m, &iov[1]);
 	}
 
-	if (byte_swapped) {
-		REDUCE;
-		sum <<= 8;
+	for (i = 0; i < iovcnt && len; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		w = iov[i].iov_base;
 		if (mlen == -1) {
+			/*
+			 * The first byte of this piece is the continuation
+			 * of a word spanning between this piece and the
+			 * last one.
+			 *
+			 * s_util.c[0] is already saved when scanning the
+			 * previous piece.
+			 */
 			s_util.c[1] = *(uint8_t *)w;
 			sum += s_util.s;
-			mlen = 0;
+			w = (uint16_t *)((int8_t *)w + 1);
+			mlen = iov[i].iov_len - 1;
+			len--;
 		} else
+			mlen = iov[i].iov_len;
+
+		if (len < mlen)
+		   mlen = len;
+		len -= mlen;
+		/*
+		 * Force to even boundary.
+		 */
+		if ((1 & (uintptr_t)w) && (mlen > 0)) {
+			REDUCE;
+			sum <<= 8;
+			s_util.c[0] = *(uint8_t *)w;
+			w = (uint16_t *)((int8_t *)w + 1);
+			mlen--;
+			byte_swapped = 1;
+		}
+		/*
+		 * Unroll the loop to make overhead from
+		 * branches &c small.
+		 */
+		while ((mlen -= 32) >= 0) {
+			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+			sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
+			sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
+			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
+			w += 16;
+		}
+		mlen += 32;
+		while ((mlen -= 8) >= 0) {
+			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+			w += 4;
+		}
+		mlen += 8;
+		if (mlen == 0 && byte_swapped == 0)
+		   continue;
+		REDUCE;
+		while ((mlen -= 2) >= 0) {
+			sum += *w++;
+		}
+
+		if (byte_swapped) {
+			REDUCE;
+			sum <<= 8;
+			byte_swapped = 0;
+			if (mlen == -1) {
+				s_util.c[1] = *(uint8_t *)w;
+				sum += s_util.s;
+				mlen = 0;
+			} else
+
+			   mlen = -1;
+		} else if (mlen == -1)
+		   s_util.c[0] = *(uint8_t *)w;
+	}
 
-		   mlen = -1;
-	} else if (mlen == -1)
-	   s_util.c[0] = *(uint8_t *)w;
-
-cont:
 #ifdef DEBUG
 	if (len) {
 		DEBUG_ERROR((dfd, "cksum: out of data\n"));
@@ -129,7 +152,7 @@ cont:
 	}
 #endif
 	if (mlen == -1) {
-		/* The last mbuf has odd # of bytes. Follow the
+		/* The last piece has odd # of bytes. Follow the
 		 standard (the odd byte may be shifted left by 8 bits
 			   or not as determined by endian-ness of the machine) */
 		s_util.c[1] = 0;
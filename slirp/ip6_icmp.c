@@ -7,6 +7,7 @@
 #include "slirp.h"
 #include "ip6_icmp.h"
 #include "qemu/timer.h"
+#include "block/aio.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
 
@@ -42,6 +43,32 @@ void icmp6_cleanup(Slirp *slirp)
     timer_free(slirp->ra_timer);
 }
 
+/* Move the RA timer to @ctx, or back to the main loop if @ctx is NULL */
+void icmp6_set_aio_context(Slirp *slirp, AioContext *ctx)
+{
+    bool pending;
+    int64_t expire;
+
+    if (!slirp->in6_enabled) {
+        return;
+    }
+
+    pending = timer_pending(slirp->ra_timer);
+    expire = timer_expire_time_ns(slirp->ra_timer);
+    timer_del(slirp->ra_timer);
+    timer_free(slirp->ra_timer);
+    if (ctx) {
+        slirp->ra_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_MS,
+                                        ra_timer_handler, slirp);
+    } else {
+        slirp->ra_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, ra_timer_handler,
+                                       slirp);
+    }
+    if (pending) {
+        timer_mod_ns(slirp->ra_timer, expire);
+    }
+}
+
 static void icmp6_send_echoreply(struct mbuf *m, Slirp *slirp, struct ip6 *ip,
         struct icmp6 *icmp)
 {
@@ -213,6 +213,7 @@ struct ndpopt {
 
 void icmp6_init(Slirp *slirp);
 void icmp6_cleanup(Slirp *slirp);
+void icmp6_set_aio_context(Slirp *slirp, AioContext *ctx);
 void icmp6_input(struct mbuf *);
 void icmp6_send_error(struct mbuf *m, uint8_t type, uint8_t code);
 void ndp_send_ra(Slirp *slirp);
@@ -95,6 +95,9 @@ ip_output(struct socket *so, struct mbuf *m0)
 		goto bad;
 	}
 
+	/* Fragments are cut from a contiguous copy */
+	m_sbuf_copy(m);
+
 	len = (IF_MTU - hlen) &~ 7;       /* ip databytes per packet */
 	if (len < 8) {
 		error = -1;
@@ -23,10 +23,21 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
 
 void slirp_pollfds_poll(GArray *pollfds, int select_error);
 
+/* for driving a single instance from an AioContext */
+void slirp_instance_pollfds_fill(Slirp *slirp, GArray *pollfds,
+                                 uint32_t *timeout);
+void slirp_instance_pollfds_poll(Slirp *slirp, GArray *pollfds,
+                                 int select_error);
+void slirp_set_aio_context(Slirp *slirp, AioContext *ctx);
+
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+void slirp_output_iov(void *opaque, const struct iovec *iov, int iovcnt);
+/* called around each burst of slirp_output() from the poll loop */
+void slirp_output_batch_begin(void *opaque);
+void slirp_output_batch_end(void *opaque);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
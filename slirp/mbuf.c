@@ -18,7 +18,12 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-#define MBUF_THRESH 30
+/*
+ * Number of mbufs kept around for reuse.  A bulk TCP transfer keeps a few
+ * windows' worth of segments in flight, each in its own mbuf; beyond this
+ * count they are freed again rather than pooled.
+ */
+#define MBUF_THRESH 512
 
 /*
  * Find a nice value for msize
@@ -93,6 +98,7 @@ m_get(Slirp *slirp)
         m->m_prevpkt = NULL;
         m->resolution_requested = false;
         m->expiration_date = (uint64_t)-1;
+        m->m_sblen = 0;
 	DEBUG_ARG("m = %p", m);
 	return m;
 }
@@ -109,6 +115,10 @@ m_free(struct mbuf *m)
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
+	if (m->m_flags & M_SBUF) {
+		QLIST_REMOVE(m, m_sbref);
+	}
+
 	/* If it's M_EXT, free() it */
         if (m->m_flags & M_EXT) {
                 g_free(m->m_ext);
@@ -177,6 +187,75 @@ m_inc(struct mbuf *m, int size)
 
 
 
+/*
+ * Let m refer to len bytes at offset off of sb rather than hold a
+ * copy of them.  sbdrop() and sbfree() copy the data into the mbufs
+ * that still refer to it before it goes away.
+ */
+void
+m_sbuf_ref(struct mbuf *m, struct sbuf *sb, int off, int len)
+{
+	char *from;
+
+	from = sb->sb_rptr + off;
+	if (from >= sb->sb_data + sb->sb_datalen)
+		from -= sb->sb_datalen;
+
+	m->m_flags |= M_SBUF;
+	m->m_sb = sb;
+	m->m_sbdata = from;
+	m->m_sblen = len;
+	QLIST_INSERT_HEAD(&sb->sb_refs, m, m_sbref);
+}
+
+/*
+ * Describe the socket buffer data of m, which may wrap around
+ * the end of the buffer.  Returns the number of iovecs used.
+ */
+int
+m_sbuf_iov(struct mbuf *m, struct iovec *iov)
+{
+	struct sbuf *sb = m->m_sb;
+	int n;
+
+	n = MIN(m->m_sblen, sb->sb_data + sb->sb_datalen - m->m_sbdata);
+	iov[0].iov_base = m->m_sbdata;
+	iov[0].iov_len = n;
+	if (n == m->m_sblen)
+		return 1;
+
+	iov[1].iov_base = sb->sb_data;
+	iov[1].iov_len = m->m_sblen - n;
+	return 2;
+}
+
+/*
+ * Copy the socket buffer data of m behind its m_len bytes,
+ * so that it no longer depends on the socket buffer.
+ */
+void
+m_sbuf_copy(struct mbuf *m)
+{
+	struct iovec iov[2];
+	int i, cnt;
+
+	if (!(m->m_flags & M_SBUF))
+		return;
+
+	if (M_FREEROOM(m) < m->m_sblen)
+		m_inc(m, m->m_size + m->m_sblen);
+
+	cnt = m_sbuf_iov(m, iov);
+	for (i = 0; i < cnt; i++) {
+		memcpy(m->m_data + m->m_len, iov[i].iov_base, iov[i].iov_len);
+		m->m_len += iov[i].iov_len;
+	}
+
+	QLIST_REMOVE(m, m_sbref);
+	m->m_flags &= ~M_SBUF;
+	m->m_sblen = 0;
+}
+
 void
 m_adj(struct mbuf *m, int len)
 {
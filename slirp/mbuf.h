@@ -63,6 +63,12 @@
 #define M_FREEROOM(m) (M_ROOM(m) - (m)->m_len)
 #define M_TRAILINGSPACE M_FREEROOM
 
+/*
+ * How much room there is in front of m_data
+ */
+#define M_HEADROOM(m) ((m)->m_data - \
+			(((m)->m_flags & M_EXT) ? (m)->m_ext : (m)->m_dat))
+
 struct mbuf {
 	/* XXX should union some of these! */
 	/* header at beginning of each mbuf: */
@@ -82,6 +88,11 @@ struct mbuf {
 	bool	resolution_requested;
 	uint64_t expiration_date;
 	char   *m_ext;
+	/* M_SBUF: the payload follows m_len bytes of headers in a socket buffer */
+	struct	sbuf *m_sb;
+	char   *m_sbdata;
+	int	m_sblen;
+	QLIST_ENTRY(mbuf) m_sbref;	/* on m_sb->sb_refs */
 	/* start of dynamic buffer area, must be last element */
 	char    m_dat[];
 };
@@ -97,6 +108,7 @@ struct mbuf {
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
 #define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
 					 * it rather than putting it on the free list */
+#define M_SBUF			0x10	/* payload is m_sblen bytes at m_sbdata */
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
@@ -107,6 +119,9 @@ void m_inc(struct mbuf *, int);
 void m_adj(struct mbuf *, int);
 int m_copy(struct mbuf *, struct mbuf *, int, int);
 struct mbuf * dtom(Slirp *, void *);
+void m_sbuf_ref(struct mbuf *, struct sbuf *, int, int);
+int m_sbuf_iov(struct mbuf *, struct iovec *);
+void m_sbuf_copy(struct mbuf *);
 
 static inline void ifs_init(struct mbuf *ifm)
 {
@@ -11,9 +11,29 @@
 
 static void sbappendsb(struct sbuf *sb, struct mbuf *m);
 
+/*
+ * Queued mbufs may still refer to the first num bytes of sb,
+ * which are about to go away; give them their own copy
+ */
+static void
+sbcopyrefs(struct sbuf *sb, int num)
+{
+	struct mbuf *m, *next;
+	int off;
+
+	QLIST_FOREACH_SAFE(m, &sb->sb_refs, m_sbref, next) {
+		off = m->m_sbdata - sb->sb_rptr;
+		if (off < 0)
+			off += sb->sb_datalen;
+		if (off < num)
+			m_sbuf_copy(m);
+	}
+}
+
 void
 sbfree(struct sbuf *sb)
 {
+	sbcopyrefs(sb, sb->sb_datalen);
 	free(sb->sb_data);
 }
 
@@ -28,6 +48,7 @@ sbdrop(struct sbuf *sb, int num)
 	 */
 	if(num > sb->sb_cc)
 		num = sb->sb_cc;
+	sbcopyrefs(sb, num);
 	sb->sb_cc -= num;
 	sb->sb_rptr += num;
 	if(sb->sb_rptr >= sb->sb_data + sb->sb_datalen)
@@ -44,6 +65,7 @@ sbreserve(struct sbuf *sb, int size)
 	if (sb->sb_data) {
 		/* Already alloced, realloc if necessary */
 		if (sb->sb_datalen != size) {
+			sbcopyrefs(sb, sb->sb_datalen);
 			sb->sb_wptr = sb->sb_rptr = sb->sb_data = (char *)realloc(sb->sb_data, size);
 			sb->sb_cc = 0;
 			if (sb->sb_wptr)
@@ -19,6 +19,7 @@ struct sbuf {
 	char	*sb_rptr;	/* read pointer. points to where the next
 				 * byte should be read from the sbuf */
 	char	*sb_data;	/* Actual data */
+	QLIST_HEAD(, mbuf) sb_refs;	/* mbufs whose payload is still here */
 };
 
 void sbfree(struct sbuf *);
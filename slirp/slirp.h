@@ -151,6 +151,8 @@ bool ndp_table_search(Slirp *slirp, struct in6_addr ip_addr,
 
 struct Slirp {
     QTAILQ_ENTRY(Slirp) entry;
+    AioContext *ctx;        /* polled from here, not the main loop, if set */
+    bool in_main_pollfds;   /* sockets were added by slirp_pollfds_fill() */
     u_int time_fasttimo;
     u_int last_slowtimo;
     bool do_slowtimo;
@@ -98,6 +98,7 @@
 	} \
 }
 #endif
+static void tcp_set_scale(struct tcpcb *tp);
 static void tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt,
                           struct tcpiphdr *ti);
 static void tcp_xmit_timer(register struct tcpcb *tp, int rtt);
@@ -475,7 +476,11 @@ findso:
 	if (tp->t_state == TCPS_CLOSED)
 		goto drop;
 
-	tiwin = ti->ti_win;
+	/* Unscale the window into a 32-bit value */
+	if ((tiflags & TH_SYN) == 0)
+		tiwin = ti->ti_win << tp->snd_scale;
+	else
+		tiwin = ti->ti_win;
 
 	/*
 	 * Segment received on connection.
@@ -804,6 +809,7 @@ findso:
 		if (tiflags & TH_ACK && SEQ_GT(tp->snd_una, tp->iss)) {
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
+			tcp_set_scale(tp);
 
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
@@ -984,6 +990,7 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+		tcp_set_scale(tp);
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1405,6 +1412,19 @@ drop:
 	m_free(m);
 }
 
+/*
+ * Start scaling windows once both sides have agreed on it in their SYNs
+ */
+static void
+tcp_set_scale(struct tcpcb *tp)
+{
+	if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+	    (TF_RCVD_SCALE|TF_REQ_SCALE)) {
+		tp->snd_scale = tp->requested_s_scale;
+		tp->rcv_scale = tp->request_r_scale;
+	}
+}
+
 static void
 tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 {
@@ -1439,6 +1459,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = MIN(cp[2], TCP_MAX_WINSHIFT);
+			break;
 		}
 	}
 }
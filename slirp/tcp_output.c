@@ -274,6 +274,15 @@ send:
 			mss = htons((uint16_t) tcp_mss(tp, 0));
 			memcpy((caddr_t)(opt + 2), (caddr_t)&mss, sizeof(mss));
 			optlen = 4;
+
+			if ((tp->t_flags & TF_REQ_SCALE) &&
+			    ((flags & TH_ACK) == 0 ||
+			    (tp->t_flags & TF_RCVD_SCALE))) {
+				opt[optlen++] = TCPOPT_NOP;
+				opt[optlen++] = TCPOPT_WINDOW;
+				opt[optlen++] = TCPOLEN_WINDOW;
+				opt[optlen++] = tp->request_r_scale;
+			}
 		}
  	}
 
@@ -289,9 +298,10 @@ send:
 	 }
 
 	/*
-	 * Grab a header mbuf, attaching a copy of data to
-	 * be transmitted, and initialize the header from
-	 * the template for sends on this connection.
+	 * Grab a header mbuf, referring to the data to be
+	 * transmitted in so_snd rather than copying it, and
+	 * initialize the header from the template for sends
+	 * on this connection.
 	 */
 	if (len) {
 		m = m_get(so->slirp);
@@ -302,8 +312,7 @@ send:
 		m->m_data += IF_MAXLINKHDR;
 		m->m_len = hdrlen;
 
-		sbcopy(&so->so_snd, off, (int) len, mtod(m, caddr_t) + hdrlen);
-		m->m_len += len;
+		m_sbuf_ref(m, &so->so_snd, off, (int) len);
 
 		/*
 		 * If we're sending everything we've got, set PUSH.
@@ -448,7 +457,7 @@ send:
 	 * to handle ttl and tos; we could keep them in
 	 * the template, but need a way to checksum without them.
 	 */
-	m->m_len = hdrlen + len; /* XXX Needed? m_len should be correct */
+	m->m_len = hdrlen; /* the data, if any, is still in so_snd */
 	tcpiph_save = *mtod(m, struct tcpiphdr *);
 
 	switch (so->so_ffamily) {
@@ -459,7 +468,7 @@ send:
 	                                         - sizeof(struct ip);
 	    ip = mtod(m, struct ip *);
 
-	    ip->ip_len = m->m_len;
+	    ip->ip_len = m->m_len + len;
 	    ip->ip_dst = tcpiph_save.ti_dst;
 	    ip->ip_src = tcpiph_save.ti_src;
 	    ip->ip_p = tcpiph_save.ti_pr;
@@ -41,10 +41,6 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-/* patchable/settable parameters for tcp */
-/* Don't do rfc1323 performance enhancements */
-#define TCP_DO_RFC1323 0
-
 /*
  * Tcp initialization
  */
@@ -264,7 +260,11 @@ tcp_newtcpcb(struct socket *so)
 	tp->seg_next = tp->seg_prev = (struct tcpiphdr*)tp;
 	tp->t_maxseg = (so->so_ffamily == AF_INET) ? TCP_MSS : TCP6_MSS;
 
-	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
+	/* RFC 1323 window scaling, but no timestamps */
+	tp->t_flags = TF_REQ_SCALE;
+	while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+	       (TCP_MAXWIN << tp->request_r_scale) < TCP_RCVSPACE)
+		tp->request_r_scale++;
 	tp->t_socket = so;
 
 	/*
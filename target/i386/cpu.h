@@ -36,6 +36,9 @@
 /* The x86 has a strong memory model with some store-after-load re-ordering */
 #define TCG_GUEST_DEFAULT_MO      (TCG_MO_ALL & ~TCG_MO_ST_LD)
 
+/* The translator can extend hot TBs into superblocks */
+#define TCG_GUEST_SUPERBLOCKS 1
+
 /* Maximum instruction code size */
 #define TARGET_MAX_INSN_SIZE 16
 
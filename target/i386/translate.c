@@ -93,6 +93,9 @@ static TCGv_i64 cpu_tmp1_i64;
 static int x86_64_hregs;
 #endif
 
+/* side exits of a superblock; it ends at the next branch once they run out */
+#define SUPERBLOCK_MAX_EXITS 8
+
 typedef struct DisasContext {
     DisasContextBase base;
 
@@ -136,6 +139,14 @@ typedef struct DisasContext {
     int cpuid_7_0_ebx_features;
     int cpuid_xsave_features;
     sigjmp_buf jmpbuf;
+
+    /* superblock formation, see gen_superblock_jcc() */
+    bool superblock;
+    int n_exits;
+    struct {
+        TCGLabel *label;
+        target_ulong eip;
+    } exits[SUPERBLOCK_MAX_EXITS];
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2230,6 +2241,98 @@ static inline void gen_jcc(DisasContext *s, int b,
     }
 }
 
+/* Can a superblock go on at 'eip', the target of a direct jump or call?
+   Only forward jumps within the page of the first insn are followed, so
+   that [tb->pc, tb->pc + tb->size) still covers all the translated code.  */
+static bool superblock_can_follow(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    return s->superblock && pc >= s->pc &&
+           (pc & TARGET_PAGE_MASK) == (s->base.pc_first & TARGET_PAGE_MASK);
+}
+
+/* Is 'eip' the start of the superblock?  A branch there closes a loop,
+   which stays within the TB by going back to base.loop_head.  */
+static bool superblock_loops_to(DisasContext *s, target_ulong eip)
+{
+    return s->superblock && s->cs_base + eip == s->base.pc_first;
+}
+
+/* Direct jump or call: within a superblock, go on translating at the
+   target instead of ending the TB; the lazy flags state is kept.  */
+static void gen_jmp_follow(DisasContext *s, target_ulong eip)
+{
+    if (superblock_loops_to(s, eip)) {
+        /* the TB is entered with cc_op in env */
+        gen_update_cc_op(s);
+        set_cc_op(s, CC_OP_DYNAMIC);
+        tcg_gen_br(s->base.loop_head);
+        s->base.is_jmp = DISAS_NORETURN;
+    } else if (superblock_can_follow(s, eip)) {
+        s->pc = s->cs_base + eip;
+    } else {
+        gen_jmp(s, eip);
+    }
+}
+
+/* Conditional jump within a superblock: go on along the path that has
+   been executed the most, and leave through a side exit otherwise.
+   A back edge to the start of the superblock loops within the TB and
+   translation goes on with the loop exit.  Other backward branches still
+   end the TB.  Returns false if the TB must end here.  */
+static bool gen_superblock_jcc(DisasContext *s, int b,
+                               target_ulong val, target_ulong next_eip)
+{
+    target_ulong exit_eip;
+    TCGLabel *l;
+
+    if (superblock_loops_to(s, val)) {
+        /* gen_jcc1 leaves cc_op in env, as the TB expects on entry */
+        gen_jcc1(s, b, s->base.loop_head);
+        return true;
+    }
+    if (!s->superblock || s->n_exits == SUPERBLOCK_MAX_EXITS ||
+        s->cs_base + val < s->pc) {
+        return false;
+    }
+    if (translator_prefer_taken(&s->base, s->cs_base + val,
+                                s->cs_base + next_eip)) {
+        if (!superblock_can_follow(s, val)) {
+            return false;
+        }
+        b ^= 1;
+        exit_eip = next_eip;
+        s->pc = s->cs_base + val;
+    } else {
+        exit_eip = val;
+    }
+
+    l = gen_new_label();
+    gen_jcc1(s, b, l);
+    s->exits[s->n_exits].label = l;
+    s->exits[s->n_exits].eip = exit_eip;
+    s->n_exits++;
+    return true;
+}
+
+/* Emit the side exits of a superblock after the end of the TB.  They are
+   expected to be cold, so they look up the next TB instead of using one of
+   the two chained jump slots.  */
+static void gen_superblock_exits(DisasContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->n_exits; i++) {
+        gen_set_label(s->exits[i].label);
+        /* gen_jcc1 left the flags in cc_op = CC_OP_DYNAMIC */
+        s->cc_op = CC_OP_DYNAMIC;
+        s->cc_op_dirty = false;
+        gen_jmp_im(s->exits[i].eip);
+        gen_jr(s, cpu_tmp0);
+    }
+}
+
 static void gen_cmovcc1(CPUX86State *env, DisasContext *s, TCGMemOp ot, int b,
                         int modrm, int reg)
 {
@@ -6525,7 +6628,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             tcg_gen_movi_tl(cpu_T0, next_eip);
             gen_push_v(s, cpu_T0);
             gen_bnd_jmp(s);
-            gen_jmp(s, tval);
+            gen_jmp_follow(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6555,7 +6658,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             tval &= 0xffffffff;
         }
         gen_bnd_jmp(s);
-        gen_jmp(s, tval);
+        gen_jmp_follow(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6577,7 +6680,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_follow(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -6595,7 +6698,9 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             tval &= 0xffff;
         }
         gen_bnd_jmp(s);
-        gen_jcc(s, b, tval, next_eip);
+        if (!gen_superblock_jcc(s, b, tval, next_eip)) {
+            gen_jcc(s, b, tval, next_eip);
+        }
         break;
 
     case 0x190 ... 0x19f: /* setcc Gv */
@@ -8450,6 +8555,9 @@ static int i386_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu,
        additional step for ecx=0 when icount is enabled.
      */
     dc->repz_opt = !dc->jmp_opt && !(tb_cflags(dc->base.tb) & CF_USE_ICOUNT);
+    dc->superblock = dc->jmp_opt &&
+                     (tb_cflags(dc->base.tb) & CF_SUPERBLOCK);
+    dc->n_exits = 0;
 #if 0
     /* check addseg logic */
     if (!dc->addseg && (dc->vm86 || !dc->pe || !dc->code32))
@@ -8542,6 +8650,7 @@ static void i386_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
         gen_jmp_im(dc->base.pc_next - dc->cs_base);
         gen_eob(dc);
     }
+    gen_superblock_exits(dc);
 }
 
 static void i386_tr_disas_log(const DisasContextBase *dcbase,
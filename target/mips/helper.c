@@ -1055,10 +1055,7 @@ void r4k_invalidate_tlb (CPUMIPSState *env, int idx, int use_extra)
         }
 #endif
         end = addr | (mask >> 1);
-        while (addr < end) {
-            tlb_flush_page(cs, addr);
-            addr += TARGET_PAGE_SIZE;
-        }
+        tlb_flush_range(cs, addr, end - addr + 1);
     }
     if (tlb->V1) {
         cs = CPU(cpu);
@@ -1069,10 +1066,7 @@ void r4k_invalidate_tlb (CPUMIPSState *env, int idx, int use_extra)
         }
 #endif
         end = addr | mask;
-        while (addr - 1 < end) {
-            tlb_flush_page(cs, addr);
-            addr += TARGET_PAGE_SIZE;
-        }
+        tlb_flush_range(cs, addr, end - addr + 1);
     }
 }
 #endif
@@ -140,7 +140,15 @@ TCGv_env cpu_env = 0;
  * dynamically allocate from as demand dictates. Given appropriate region
  * sizing, this minimizes flushes even when some TCG threads generate a lot
  * more code than others.
+ *
+ * Once all regions have been handed out, full regions can be evicted one at
+ * a time (see tcg_region_evict) instead of flushing the whole buffer.
  */
+struct tcg_region_info {
+    uint64_t seq;  /* when the region was last assigned; 0 if never */
+    bool free;     /* evicted, and therefore available for reuse */
+};
+
 struct tcg_region_state {
     QemuMutex lock;
 
@@ -155,6 +163,8 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    struct tcg_region_info *info; /* per-region state, .n elements */
+    uint64_t seq; /* assignment counter, used to order regions by age */
 };
 
 static struct tcg_region_state region;
@@ -323,16 +333,27 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
     s->code_gen_ptr = start;
     s->code_gen_buffer_size = end - start;
     s->code_gen_highwater = end - TCG_HIGHWATER;
+    region.info[curr_region].seq = ++region.seq;
+    region.info[curr_region].free = false;
 }
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i;
+
+    if (region.current < region.n) {
+        tcg_region_assign(s, region.current);
+        region.current++;
+        return false;
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
-    return false;
+    /* all regions have been handed out; reuse one that has been evicted */
+    for (i = 0; i < region.n; i++) {
+        if (region.info[i].free) {
+            tcg_region_assign(s, i);
+            return false;
+        }
+    }
+    return true;
 }
 
 /*
@@ -372,6 +393,7 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    memset(region.info, 0, region.n * sizeof(*region.info));
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = atomic_read(&tcg_ctxs[i]);
@@ -382,6 +404,85 @@ void tcg_region_reset_all(void)
     qemu_mutex_unlock(&region.lock);
 }
 
+size_t tcg_region_count(void)
+{
+    return region.n;
+}
+
+/* Returns the index of the region that contains @p */
+size_t tcg_region_index(const void *p)
+{
+    size_t i;
+
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    i = (p - region.start_aligned) / region.stride;
+    return MIN(i, region.n - 1);
+}
+
+static bool tcg_region_in_use__locked(size_t i)
+{
+    unsigned int n_ctxs = atomic_read(&n_tcg_ctxs);
+    unsigned int j;
+
+    for (j = 0; j < n_ctxs; j++) {
+        TCGContext *s = atomic_read(&tcg_ctxs[j]);
+
+        if (tcg_region_index(s->code_gen_buffer) == i) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Evict the coldest full region, i.e. one that no TCG context is currently
+ * filling. @hits is indexed by region and gives an estimate of how much of
+ * each region's code has been recently executed; among the regions with
+ * the fewest hits, the one that was assigned the longest ago is picked.
+ * @evict_fn is called with the bounds of the victim so that the caller can
+ * drop all TBs in it; the region is then made available for reuse.
+ *
+ * Returns false if there was no region to evict (e.g. when using a single
+ * region), in which case the caller must flush the whole buffer instead.
+ *
+ * Call from a safe-work context.
+ */
+bool tcg_region_evict(const size_t *hits,
+                      void (*evict_fn)(void *start, void *end))
+{
+    size_t victim = region.n;
+    void *start, *end;
+    size_t i;
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < region.n; i++) {
+        const struct tcg_region_info *info = &region.info[i];
+
+        if (info->seq == 0 || info->free || tcg_region_in_use__locked(i)) {
+            continue;
+        }
+        if (victim == region.n ||
+            hits[i] < hits[victim] ||
+            (hits[i] == hits[victim] && info->seq < region.info[victim].seq)) {
+            victim = i;
+        }
+    }
+    if (victim == region.n) {
+        qemu_mutex_unlock(&region.lock);
+        return false;
+    }
+
+    tcg_region_bounds(victim, &start, &end);
+    evict_fn(start, end);
+
+    region.info[victim].free = true;
+    region.agg_size_full -= end - start - TCG_HIGHWATER;
+    qemu_mutex_unlock(&region.lock);
+    return true;
+}
+
 #ifdef CONFIG_USER_ONLY
 static size_t tcg_n_regions(void)
 {
@@ -396,27 +497,34 @@ static size_t tcg_n_regions(void)
  */
 static size_t tcg_n_regions(void)
 {
+    size_t n_threads;
     size_t i;
 
-    /* Use a single region if all we have is one vCPU thread */
+    /* Without MTTCG all vCPUs share a single TCG thread */
     if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
-        return 1;
+        n_threads = 1;
+    } else {
+        n_threads = max_cpus;
     }
 
-    /* Try to have more regions than max_cpus, with each region being >= 2 MB */
+    /*
+     * Try to have more regions than threads, with each region being >= 2 MB.
+     * This also gives a single thread several regions, so that running out
+     * of space evicts one region instead of flushing all translated code.
+     */
     for (i = 8; i > 0; i--) {
         size_t regions_per_thread = i;
         size_t region_size;
 
         region_size = tcg_init_ctx.code_gen_buffer_size;
-        region_size /= max_cpus * regions_per_thread;
+        region_size /= n_threads * regions_per_thread;
 
         if (region_size >= 2 * 1024u * 1024) {
-            return max_cpus * regions_per_thread;
+            return n_threads * regions_per_thread;
         }
     }
     /* If we can't, then just allocate one region per vCPU thread */
-    return max_cpus;
+    return n_threads;
 }
 #endif
 
@@ -431,7 +539,9 @@ static size_t tcg_n_regions(void)
  * code in parallel without synchronization.
  *
  * In softmmu the number of TCG threads is bounded by max_cpus, so we use at
- * least max_cpus regions in MTTCG. In !MTTCG we use a single region.
+ * least max_cpus regions in MTTCG. In !MTTCG the single TCG thread still gets
+ * several regions if the buffer is large enough, so that they can be evicted
+ * individually.
  * Note that the TCG options from the command-line (i.e. -accel accel=tcg,[...])
  * must have been parsed before calling this function, since it calls
  * qemu_tcg_mttcg_enabled().
@@ -481,6 +591,7 @@ void tcg_region_init(void)
     region.stride = region_size;
     region.start = buf;
     region.start_aligned = aligned;
+    region.info = g_new0(struct tcg_region_info, n_regions);
     /* page-align the end, since its last page will be a guard page */
     region.end = QEMU_ALIGN_PTR_DOWN(buf + size, page_size);
     /* account for that last guard page */
@@ -2069,6 +2180,34 @@ static void tcg_la_bb_end(TCGContext *s)
     }
 }
 
+/* liveness analysis: conditional branch within a superblock: all temps are
+   dead, globals and local temps should be in memory but stay live in
+   registers for the fall-through path. */
+static void tcg_la_bb_sync(TCGContext *s)
+{
+    int ng = s->nb_globals;
+    int nt = s->nb_temps;
+    int i;
+
+    for (i = 0; i < ng; ++i) {
+        s->temps[i].state |= TS_MEM;
+    }
+    for (i = ng; i < nt; ++i) {
+        s->temps[i].state = (s->temps[i].temp_local
+                             ? s->temps[i].state | TS_MEM
+                             : TS_DEAD);
+    }
+}
+
+/* Conditional branches only end the basic block of the branch target when
+   translating a superblock, so that the fall-through path can keep using
+   the registers that hold globals. */
+static inline bool tcg_op_syncs_bb(TCGContext *s, const TCGOpDef *def)
+{
+    return (def->flags & TCG_OPF_COND_BRANCH) &&
+           (s->tb_cflags & CF_SUPERBLOCK);
+}
+
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -2267,7 +2406,9 @@ static void liveness_pass_1(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (tcg_op_syncs_bb(s, def)) {
+                    tcg_la_bb_sync(s);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -2338,7 +2479,10 @@ static bool liveness_pass_2(TCGContext *s)
             nb_oargs = def->nb_oargs;
 
             /* Set flags similar to how calls require.  */
-            if (def->flags & TCG_OPF_BB_END) {
+            if (tcg_op_syncs_bb(s, def)) {
+                /* Like reading globals: sync_globals */
+                call_flags = TCG_CALL_NO_WRITE_GLOBALS;
+            } else if (def->flags & TCG_OPF_BB_END) {
                 /* Like writing globals: save_globals */
                 call_flags = 0;
             } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
@@ -2733,6 +2877,28 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch within a superblock, we assume all temporaries
+   are dead and that globals and local temps are synced to their canonical
+   location, but may still be in registers. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    sync_globals(s, allocated_regs);
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        /* The liveness analysis already ensures that temps are dead and
+           that local temps are synced.  Keep tcg_debug_asserts for safety. */
+        if (ts->temp_local) {
+            tcg_debug_assert(ts->val_type != TEMP_VAL_REG
+                             || ts->mem_coherent);
+        } else {
+            tcg_debug_assert(ts->val_type == TEMP_VAL_DEAD);
+        }
+    }
+}
+
 static void tcg_reg_alloc_do_movi(TCGContext *s, TCGTemp *ots,
                                   tcg_target_ulong val, TCGLifeData arg_life)
 {
@@ -2928,7 +3094,9 @@ static void tcg_reg_alloc_op(TCGContext *s, const TCGOp *op)
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (tcg_op_syncs_bb(s, def)) {
+        tcg_reg_alloc_cbranch(s, i_allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, i_allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
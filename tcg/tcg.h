@@ -846,6 +846,10 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_init(void);
 void tcg_region_reset_all(void);
+size_t tcg_region_count(void);
+size_t tcg_region_index(const void *p);
+bool tcg_region_evict(const size_t *hits,
+                      void (*evict_fn)(void *start, void *end));
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
@@ -972,6 +976,10 @@ enum {
     TCG_OPF_NOT_PRESENT  = 0x10,
     /* Instruction operands are vectors.  */
     TCG_OPF_VECTOR       = 0x20,
+    /* Instruction is a conditional branch.  Within a superblock it does not
+       end the basic block for the fall-through path: globals are synced to
+       memory but may stay in registers.  */
+    TCG_OPF_COND_BRANCH  = 0x40,
 };
 
 typedef struct TCGOpDef {
@@ -0,0 +1,109 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define PAGES 256
+
+/*
+ * Each page of the new buffer differs from the old one in @runs places,
+ * @run_len bytes each.  This covers the range from a few scattered
+ * stores to pages that are mostly rewritten.
+ */
+typedef struct XBZRLEBenchCase {
+    const char *name;
+    int runs;
+    int run_len;
+} XBZRLEBenchCase;
+
+static const XBZRLEBenchCase cases[] = {
+    { "unchanged", 0, 0 },
+    { "sparse", 4, 8 },
+    { "scattered", 32, 16 },
+    { "dense", 8, 256 },
+};
+
+static void bench_fill(uint8_t *old_buf, uint8_t *new_buf,
+                       const XBZRLEBenchCase *c)
+{
+    int i, j, k, start;
+
+    for (i = 0; i < PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, PAGES * PAGE_SIZE);
+
+    for (i = 0; i < PAGES; i++) {
+        for (j = 0; j < c->runs; j++) {
+            start = g_test_rand_int_range(0, PAGE_SIZE - c->run_len);
+            for (k = 0; k < c->run_len; k++) {
+                new_buf[i * PAGE_SIZE + start + k] ^= 0xa5;
+            }
+        }
+    }
+}
+
+static void bench_case(const XBZRLEBenchCase *c, uint8_t *old_buf,
+                       uint8_t *new_buf, uint8_t *dst)
+{
+    double total = 0.0;
+    int i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < PAGES; i++) {
+            xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                 new_buf + i * PAGE_SIZE,
+                                 PAGE_SIZE, dst, PAGE_SIZE);
+        }
+        total += PAGES * PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 2.0);
+
+    total /= 1024 * 1024; /* to MB */
+    g_print("xbzrle %s (%s): ", c->name, xbzrle_encode_accel_name());
+    g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+}
+
+static void test_xbzrle_speed(void)
+{
+    uint8_t *old_buf[ARRAY_SIZE(cases)], *new_buf[ARRAY_SIZE(cases)];
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        old_buf[i] = g_malloc(PAGES * PAGE_SIZE);
+        new_buf[i] = g_malloc(PAGES * PAGE_SIZE);
+        bench_fill(old_buf[i], new_buf[i], &cases[i]);
+    }
+
+    /* xbzrle_encode_next_accel() cannot go back, so walk the encoders
+     * from the most preferred one down and run every case on each.
+     */
+    do {
+        for (i = 0; i < ARRAY_SIZE(cases); i++) {
+            bench_case(&cases[i], old_buf[i], new_buf[i], dst);
+        }
+    } while (xbzrle_encode_next_accel());
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        g_free(old_buf[i]);
+        g_free(new_buf[i]);
+    }
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/speed", test_xbzrle_speed);
+
+    return g_test_run();
+}
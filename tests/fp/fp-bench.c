@@ -0,0 +1,322 @@
+/*
+ * fp-bench.c - A collection of simple floating point microbenchmarks.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/timer.h"
+#include "fpu/softfloat.h"
+
+enum op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_FMA,
+    OP_SQRT,
+};
+
+static const char * const op_names[] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_FMA] = "fma",
+    [OP_SQRT] = "sqrt",
+};
+
+enum precision {
+    PREC_SINGLE,
+    PREC_DOUBLE,
+};
+
+static const char * const prec_names[] = {
+    [PREC_SINGLE] = "single",
+    [PREC_DOUBLE] = "double",
+};
+
+enum tester {
+    TESTER_SOFT,
+    TESTER_HOST,
+};
+
+static const char * const tester_names[] = {
+    [TESTER_SOFT] = "soft",
+    [TESTER_HOST] = "host",
+};
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+#define MAX_OPERANDS 3
+#define OPS_PER_ITER 50
+
+static enum op op = OP_ADD;
+static enum precision precision = PREC_SINGLE;
+static enum tester tester = TESTER_SOFT;
+static unsigned int duration = 1;
+static bool clear_inexact;
+static uint64_t random_seed = 0xdeadbeef;
+static float_status soft_status;
+
+static uint64_t n_ops;
+static int64_t ns_elapsed;
+
+static const char commands_string[] =
+    " -o = floating point operation (add, sub, mul, div, fma, sqrt)."
+    " Default: add\n"
+    " -p = precision (single, double). Default: single\n"
+    " -t = tester (soft, host). Default: soft\n"
+    " -d = duration in seconds. Default: 1\n"
+    " -z = clear the inexact flag before each operation, which keeps\n"
+    "      softfloat from using the host FPU";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Normal positive operands whose results stay well clear of overflow
+ * and underflow, so that the benchmark measures the common case.
+ */
+static float random_float(uint64_t r)
+{
+    return 1.0f + (float)(r & 0xffffff) / (1 << 24);
+}
+
+static double random_double(uint64_t r)
+{
+    return 1.0 + (double)(r & 0xfffffffffffffULL) / (1ULL << 52);
+}
+
+static void fill_random(union_float32 *f, union_float64 *d, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        random_seed = xorshift64star(random_seed);
+        f[i].h = random_float(random_seed);
+        d[i].h = random_double(random_seed);
+    }
+}
+
+static void bench(void)
+{
+    union_float32 fa[MAX_OPERANDS], fr;
+    union_float64 da[MAX_OPERANDS], dr;
+    int64_t t0;
+    uint64_t i;
+    int j;
+
+    fr.h = 0;
+    dr.h = 0;
+    t0 = get_clock();
+    for (i = 0; ; i++) {
+        if ((i & 0xff) == 0 &&
+            get_clock() - t0 >= duration * NANOSECONDS_PER_SECOND) {
+            break;
+        }
+        fill_random(fa, da, MAX_OPERANDS);
+
+        for (j = 0; j < OPS_PER_ITER; j++) {
+            if (clear_inexact) {
+                soft_status.float_exception_flags = 0;
+            }
+            if (precision == PREC_SINGLE) {
+                float32 a = fa[0].s, b = fa[1].s, c = fa[2].s;
+
+                if (tester == TESTER_HOST) {
+                    float ha = fa[0].h, hb = fa[1].h, hc = fa[2].h;
+
+                    switch (op) {
+                    case OP_ADD:
+                        fr.h = ha + hb;
+                        break;
+                    case OP_SUB:
+                        fr.h = ha - hb;
+                        break;
+                    case OP_MUL:
+                        fr.h = ha * hb;
+                        break;
+                    case OP_DIV:
+                        fr.h = ha / hb;
+                        break;
+                    case OP_FMA:
+                        fr.h = fmaf(ha, hb, hc);
+                        break;
+                    case OP_SQRT:
+                        fr.h = sqrtf(ha);
+                        break;
+                    }
+                } else {
+                    switch (op) {
+                    case OP_ADD:
+                        fr.s = float32_add(a, b, &soft_status);
+                        break;
+                    case OP_SUB:
+                        fr.s = float32_sub(a, b, &soft_status);
+                        break;
+                    case OP_MUL:
+                        fr.s = float32_mul(a, b, &soft_status);
+                        break;
+                    case OP_DIV:
+                        fr.s = float32_div(a, b, &soft_status);
+                        break;
+                    case OP_FMA:
+                        fr.s = float32_muladd(a, b, c, 0, &soft_status);
+                        break;
+                    case OP_SQRT:
+                        fr.s = float32_sqrt(a, &soft_status);
+                        break;
+                    }
+                }
+                /* Chain the result so that the compiler keeps the op */
+                fa[0].s = fr.s;
+            } else {
+                float64 a = da[0].s, b = da[1].s, c = da[2].s;
+
+                if (tester == TESTER_HOST) {
+                    double ha = da[0].h, hb = da[1].h, hc = da[2].h;
+
+                    switch (op) {
+                    case OP_ADD:
+                        dr.h = ha + hb;
+                        break;
+                    case OP_SUB:
+                        dr.h = ha - hb;
+                        break;
+                    case OP_MUL:
+                        dr.h = ha * hb;
+                        break;
+                    case OP_DIV:
+                        dr.h = ha / hb;
+                        break;
+                    case OP_FMA:
+                        dr.h = fma(ha, hb, hc);
+                        break;
+                    case OP_SQRT:
+                        dr.h = sqrt(ha);
+                        break;
+                    }
+                } else {
+                    switch (op) {
+                    case OP_ADD:
+                        dr.s = float64_add(a, b, &soft_status);
+                        break;
+                    case OP_SUB:
+                        dr.s = float64_sub(a, b, &soft_status);
+                        break;
+                    case OP_MUL:
+                        dr.s = float64_mul(a, b, &soft_status);
+                        break;
+                    case OP_DIV:
+                        dr.s = float64_div(a, b, &soft_status);
+                        break;
+                    case OP_FMA:
+                        dr.s = float64_muladd(a, b, c, 0, &soft_status);
+                        break;
+                    case OP_SQRT:
+                        dr.s = float64_sqrt(a, &soft_status);
+                        break;
+                    }
+                }
+                da[0].s = dr.s;
+            }
+        }
+        n_ops += OPS_PER_ITER;
+    }
+    ns_elapsed = get_clock() - t0;
+}
+
+static int find_name(const char * const *names, int n, const char *name)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Unknown option value '%s'\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:o:p:t:z");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'o':
+            op = find_name(op_names, ARRAY_SIZE(op_names), optarg);
+            break;
+        case 'p':
+            precision = find_name(prec_names, ARRAY_SIZE(prec_names), optarg);
+            break;
+        case 't':
+            tester = find_name(tester_names, ARRAY_SIZE(tester_names), optarg);
+            break;
+        case 'z':
+            clear_inexact = true;
+            break;
+        default:
+            usage_complete(argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void pr_stats(void)
+{
+    printf("%s %s %s%s: %.2f MFlops\n", tester_names[tester],
+           prec_names[precision], op_names[op],
+           clear_inexact ? " (inexact cleared)" : "",
+           (double)n_ops / ns_elapsed * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+
+    /* Guests typically run with the sticky inexact flag already set */
+    set_float_rounding_mode(float_round_nearest_even, &soft_status);
+    soft_status.float_exception_flags = float_flag_inexact;
+
+    bench();
+    pr_stats();
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * fp-test.c - Check that the softfloat host FPU fast paths agree with
+ * the pure softfloat implementation.
+ *
+ * softfloat only uses the host FPU when the inexact flag is already set,
+ * so running every operation twice, once with the flag clear and once
+ * with it preset, compares the two implementations.  Results must be
+ * bit-identical and all flags other than inexact must match.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "fpu/softfloat.h"
+
+#define N_ITERS 1000000
+
+enum op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_FMA,
+    OP_SQRT,
+};
+
+static const char * const op_names[] = {
+    [OP_ADD] = "add",
+    [OP_SUB] = "sub",
+    [OP_MUL] = "mul",
+    [OP_DIV] = "div",
+    [OP_FMA] = "fma",
+    [OP_SQRT] = "sqrt",
+};
+
+/* Same generator as fp-bench */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Half of the operands have an exponent close to 1.0, so that
+ * additions and subtractions of similar values (and the rounding
+ * corner cases that come with them) are frequent.  The other half use
+ * the whole encoding space, which exercises the overflow, underflow,
+ * denormal, infinity and NaN fallbacks.
+ */
+static float32 random_float32(uint64_t r)
+{
+    uint32_t v = r >> 32;
+
+    if (r & 1) {
+        v = (v & 0x807fffff) | ((127 - 16 + ((r >> 1) & 31)) << 23);
+    }
+    return make_float32(v);
+}
+
+static float64 random_float64(uint64_t r)
+{
+    uint64_t v = r;
+
+    if (r & 1) {
+        v = (v & 0x800fffffffffffffULL) |
+            ((uint64_t)(1023 - 32 + ((r >> 1) & 63)) << 52);
+    }
+    return make_float64(v);
+}
+
+static float32 run_f32(enum op op, float32 *a, float_status *s)
+{
+    switch (op) {
+    case OP_ADD:
+        return float32_add(a[0], a[1], s);
+    case OP_SUB:
+        return float32_sub(a[0], a[1], s);
+    case OP_MUL:
+        return float32_mul(a[0], a[1], s);
+    case OP_DIV:
+        return float32_div(a[0], a[1], s);
+    case OP_FMA:
+        return float32_muladd(a[0], a[1], a[2], 0, s);
+    case OP_SQRT:
+        return float32_sqrt(a[0], s);
+    }
+    g_assert_not_reached();
+}
+
+static float64 run_f64(enum op op, float64 *a, float_status *s)
+{
+    switch (op) {
+    case OP_ADD:
+        return float64_add(a[0], a[1], s);
+    case OP_SUB:
+        return float64_sub(a[0], a[1], s);
+    case OP_MUL:
+        return float64_mul(a[0], a[1], s);
+    case OP_DIV:
+        return float64_div(a[0], a[1], s);
+    case OP_FMA:
+        return float64_muladd(a[0], a[1], a[2], 0, s);
+    case OP_SQRT:
+        return float64_sqrt(a[0], s);
+    }
+    g_assert_not_reached();
+}
+
+static void test_f32(gconstpointer opaque)
+{
+    enum op op = GPOINTER_TO_INT(opaque);
+    uint64_t seed = 0xdeadbeef;
+    int i, j;
+
+    for (i = 0; i < N_ITERS; i++) {
+        float_status soft = { .float_exception_flags = 0 };
+        float_status host = { .float_exception_flags = float_flag_inexact };
+        float32 a[3], rs, rh;
+
+        for (j = 0; j < ARRAY_SIZE(a); j++) {
+            seed = xorshift64star(seed);
+            a[j] = random_float32(seed);
+        }
+        rs = run_f32(op, a, &soft);
+        rh = run_f32(op, a, &host);
+        if (float32_val(rs) != float32_val(rh) ||
+            (soft.float_exception_flags & ~float_flag_inexact) !=
+            (host.float_exception_flags & ~float_flag_inexact)) {
+            g_test_message("%s %08x %08x %08x: soft %08x flags %02x, "
+                           "host %08x flags %02x", op_names[op],
+                           float32_val(a[0]), float32_val(a[1]),
+                           float32_val(a[2]),
+                           float32_val(rs), soft.float_exception_flags,
+                           float32_val(rh), host.float_exception_flags);
+            g_assert_cmphex(float32_val(rs), ==, float32_val(rh));
+            g_assert_cmphex(soft.float_exception_flags & ~float_flag_inexact,
+                            ==,
+                            host.float_exception_flags & ~float_flag_inexact);
+        }
+    }
+}
+
+static void test_f64(gconstpointer opaque)
+{
+    enum op op = GPOINTER_TO_INT(opaque);
+    uint64_t seed = 0xdeadbeef;
+    int i, j;
+
+    for (i = 0; i < N_ITERS; i++) {
+        float_status soft = { .float_exception_flags = 0 };
+        float_status host = { .float_exception_flags = float_flag_inexact };
+        float64 a[3], rs, rh;
+
+        for (j = 0; j < ARRAY_SIZE(a); j++) {
+            seed = xorshift64star(seed);
+            a[j] = random_float64(seed);
+        }
+        rs = run_f64(op, a, &soft);
+        rh = run_f64(op, a, &host);
+        if (float64_val(rs) != float64_val(rh) ||
+            (soft.float_exception_flags & ~float_flag_inexact) !=
+            (host.float_exception_flags & ~float_flag_inexact)) {
+            g_test_message("%s %016" PRIx64 " %016" PRIx64 " %016" PRIx64
+                           ": soft %016" PRIx64 " flags %02x, "
+                           "host %016" PRIx64 " flags %02x", op_names[op],
+                           float64_val(a[0]), float64_val(a[1]),
+                           float64_val(a[2]),
+                           float64_val(rs), soft.float_exception_flags,
+                           float64_val(rh), host.float_exception_flags);
+            g_assert_cmphex(float64_val(rs), ==, float64_val(rh));
+            g_assert_cmphex(soft.float_exception_flags & ~float_flag_inexact,
+                            ==,
+                            host.float_exception_flags & ~float_flag_inexact);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    for (i = 0; i < ARRAY_SIZE(op_names); i++) {
+        char *path;
+
+        path = g_strdup_printf("/softfloat/f32/%s", op_names[i]);
+        g_test_add_data_func(path, GINT_TO_POINTER(i), test_f32);
+        g_free(path);
+        path = g_strdup_printf("/softfloat/f64/%s", op_names[i]);
+        g_test_add_data_func(path, GINT_TO_POINTER(i), test_f64);
+        g_free(path);
+    }
+    return g_test_run();
+}
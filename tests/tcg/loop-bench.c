@@ -0,0 +1,184 @@
+/*
+ * Loop-heavy guest code, to measure TCG superblocks.
+ *
+ * Each kernel spends its time in small loops whose bodies contain
+ * forward branches, which is where superblocks help: compare the times
+ * of "qemu-i386 ./loop-bench-i386" and "qemu-i386 -superblocks
+ * ./loop-bench-i386". The checksums must not change.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define N 4096
+
+static uint32_t buf[N];
+static uint8_t sieve[1 << 16];
+
+static uint32_t xorshift32(uint32_t x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/* if/else diamonds in the loop body */
+static uint32_t bench_branchy(int iters)
+{
+    uint32_t sum = 0;
+    int i, j;
+
+    for (i = 0; i < iters; i++) {
+        for (j = 0; j < N; j++) {
+            uint32_t v = buf[j];
+
+            if (v & 1) {
+                sum += v >> 3;
+            } else {
+                sum ^= v << 1;
+            }
+            if (v > 0x80000000u) {
+                sum++;
+            }
+        }
+    }
+    return sum;
+}
+
+/* inner loop with an early exit that is rarely taken */
+static uint32_t bench_search(int iters)
+{
+    uint32_t found = 0;
+    int i, j;
+
+    for (i = 0; i < iters; i++) {
+        uint32_t key = xorshift32(i + 1);
+
+        for (j = 0; j < N; j++) {
+            if (buf[j] == key) {
+                found++;
+                break;
+            }
+        }
+        found += j;
+    }
+    return found;
+}
+
+static uint32_t bench_sieve(int iters)
+{
+    uint32_t count = 0;
+    int i, j, k;
+
+    for (i = 0; i < iters; i++) {
+        memset(sieve, 1, sizeof(sieve));
+        for (j = 2; j < (int)sizeof(sieve); j++) {
+            if (!sieve[j]) {
+                continue;
+            }
+            count++;
+            for (k = 2 * j; k < (int)sizeof(sieve); k += j) {
+                sieve[k] = 0;
+            }
+        }
+    }
+    return count;
+}
+
+static uint32_t bench_crc(int iters)
+{
+    uint32_t crc = ~0u;
+    int i, j, b;
+
+    for (i = 0; i < iters; i++) {
+        for (j = 0; j < N; j++) {
+            crc ^= buf[j] & 0xff;
+            for (b = 0; b < 8; b++) {
+                if (crc & 1) {
+                    crc = (crc >> 1) ^ 0xedb88320u;
+                } else {
+                    crc >>= 1;
+                }
+            }
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t bench_sort(int iters)
+{
+    static uint32_t a[1024];
+    uint32_t sum = 0;
+    int i, j, k;
+
+    for (i = 0; i < iters; i++) {
+        for (j = 0; j < 1024; j++) {
+            a[j] = buf[(j * 7 + i) % N];
+        }
+        /* insertion sort */
+        for (j = 1; j < 1024; j++) {
+            uint32_t v = a[j];
+
+            for (k = j - 1; k >= 0 && a[k] > v; k--) {
+                a[k + 1] = a[k];
+            }
+            a[k + 1] = v;
+        }
+        sum += a[i % 1024];
+    }
+    return sum;
+}
+
+static const struct {
+    const char *name;
+    uint32_t (*fn)(int iters);
+    int iters;
+} benches[] = {
+    { "branchy", bench_branchy, 20000 },
+    { "search",  bench_search,  40000 },
+    { "sieve",   bench_sieve,   300 },
+    { "crc",     bench_crc,     1500 },
+    { "sort",    bench_sort,    400 },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    double total = 0;
+    uint32_t seed = 1;
+    size_t i;
+
+    for (i = 0; i < N; i++) {
+        seed = xorshift32(seed);
+        buf[i] = seed;
+    }
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const char *only = argc > 1 ? argv[1] : NULL;
+        double t0, t;
+        uint32_t res;
+
+        if (only && strcmp(only, benches[i].name)) {
+            continue;
+        }
+        t0 = now();
+        res = benches[i].fn(benches[i].iters);
+        t = now() - t0;
+        total += t;
+        printf("%-8s %8.3f s  checksum %08x\n", benches[i].name, t, res);
+    }
+    printf("%-8s %8.3f s\n", "total", total);
+    return 0;
+}
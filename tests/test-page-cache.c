@@ -0,0 +1,213 @@
+/*
+ * XBZRLE page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "../migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+/* Must match PAGE_CACHE_WAYS in migration/page_cache.c */
+#define WAYS 8
+
+static uint8_t page[PAGE_SIZE];
+
+static uint64_t page_addr(int i)
+{
+    return (uint64_t)i * PAGE_SIZE;
+}
+
+static void fill_page(int i)
+{
+    memset(page, i & 0xff, PAGE_SIZE);
+    memcpy(page, &i, sizeof(i));
+}
+
+static bool page_matches(PageCache *cache, int i)
+{
+    uint8_t *data = get_cached_data(cache, page_addr(i));
+
+    fill_page(i);
+    return data && !memcmp(data, page, PAGE_SIZE);
+}
+
+static int count_cached(PageCache *cache, int n)
+{
+    int i, count = 0;
+
+    for (i = 0; i < n; i++) {
+        count += !!get_cached_data(cache, page_addr(i));
+    }
+    return count;
+}
+
+static void test_init(void)
+{
+    Error *err = NULL;
+    PageCache *cache;
+
+    /* Smaller than a page */
+    cache = cache_init(PAGE_SIZE - 1, PAGE_SIZE, &err);
+    g_assert(!cache);
+    error_free_or_abort(&err);
+
+    /* Not a power of two number of pages */
+    cache = cache_init(3 * PAGE_SIZE, PAGE_SIZE, &err);
+    g_assert(!cache);
+    error_free_or_abort(&err);
+
+    cache = cache_init(16 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    g_assert(cache);
+    g_assert_cmpint(count_cached(cache, 64), ==, 0);
+    cache_fini(cache);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(1024 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        fill_page(i);
+        g_assert_cmpint(cache_insert(cache, page_addr(i), page, 0), ==, 0);
+    }
+    for (i = 0; i < 64; i++) {
+        g_assert(cache_is_cached(cache, page_addr(i), 0));
+        g_assert(page_matches(cache, i));
+    }
+    g_assert(!cache_is_cached(cache, page_addr(64), 0));
+    g_assert(!get_cached_data(cache, page_addr(64)));
+
+    /* Inserting a cached page again updates its data in place */
+    fill_page(1000);
+    g_assert_cmpint(cache_insert(cache, page_addr(5), page, 0), ==, 0);
+    g_assert(!memcmp(get_cached_data(cache, page_addr(5)), page, PAGE_SIZE));
+    g_assert_cmpint(count_cached(cache, 64), ==, 64);
+
+    cache_fini(cache);
+}
+
+/* A cache of WAYS pages is a single set */
+static void test_lru_eviction(void)
+{
+    PageCache *cache = cache_init(WAYS * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    int i;
+
+    for (i = 0; i < WAYS; i++) {
+        fill_page(i);
+        g_assert_cmpint(cache_insert(cache, page_addr(i), page, 0), ==, 0);
+    }
+
+    /* All pages of the set were used in the last two generations */
+    fill_page(WAYS);
+    g_assert_cmpint(cache_insert(cache, page_addr(WAYS), page, 1), ==, -1);
+    g_assert(!get_cached_data(cache, page_addr(WAYS)));
+
+    /* Page 0 is the least recently used one */
+    g_assert_cmpint(cache_insert(cache, page_addr(WAYS), page, 2), ==, 1);
+    g_assert(!get_cached_data(cache, page_addr(0)));
+    g_assert(page_matches(cache, WAYS));
+
+    /* A hit makes page 1 recently used, so page 2 goes next */
+    g_assert(cache_is_cached(cache, page_addr(1), 2));
+    fill_page(WAYS + 1);
+    g_assert_cmpint(cache_insert(cache, page_addr(WAYS + 1), page, 2), ==, 1);
+    g_assert(page_matches(cache, 1));
+    g_assert(!get_cached_data(cache, page_addr(2)));
+    g_assert(page_matches(cache, WAYS + 1));
+    g_assert_cmpint(count_cached(cache, WAYS + 2), ==, WAYS);
+
+    cache_fini(cache);
+}
+
+/*
+ * In a cache of several sets, fill one set with fresh pages.  Only a page
+ * of that set is evicted to make room, and the other sets are untouched.
+ */
+static void test_same_set_eviction(void)
+{
+    PageCache *cache = cache_init(4 * WAYS * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    int i, full = -1;
+
+    for (i = 0; i < 4 * WAYS + 1; i++) {
+        int ret;
+
+        fill_page(i);
+        ret = cache_insert(cache, page_addr(i), page, 0);
+        if (ret < 0) {
+            full = i;
+            break;
+        }
+        g_assert_cmpint(ret, ==, 0);
+    }
+    /* Some set must be full by the time there are more pages than items */
+    g_assert_cmpint(full, >=, WAYS);
+    g_assert_cmpint(count_cached(cache, full), ==, full);
+
+    fill_page(full);
+    g_assert_cmpint(cache_insert(cache, page_addr(full), page, 2), ==, 1);
+    g_assert(page_matches(cache, full));
+    g_assert_cmpint(count_cached(cache, full), ==, full - 1);
+    for (i = 0; i < full; i++) {
+        g_assert(!get_cached_data(cache, page_addr(i)) ||
+                 page_matches(cache, i));
+    }
+
+    cache_fini(cache);
+}
+
+/* Resizing replaces the cache with a new, empty one of the new size */
+static void test_resize(void)
+{
+    static const int sizes[] = { 1, 4, WAYS, 2 * WAYS, 4 };
+    PageCache *cache = NULL;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        int n = sizes[i];
+        int evictions = 0;
+        PageCache *new_cache;
+
+        new_cache = cache_init(n * PAGE_SIZE, PAGE_SIZE, &error_abort);
+        if (cache) {
+            cache_fini(cache);
+        }
+        cache = new_cache;
+        g_assert_cmpint(count_cached(cache, 64), ==, 0);
+
+        /* Pages are old enough to be evicted at once */
+        for (j = 0; j < 64; j++) {
+            int ret;
+
+            fill_page(j);
+            ret = cache_insert(cache, page_addr(j), page, 2 * j + 2);
+            g_assert_cmpint(ret, >=, 0);
+            evictions += ret;
+        }
+        g_assert_cmpint(count_cached(cache, 64) + evictions, ==, 64);
+        g_assert_cmpint(count_cached(cache, 64), <=, n);
+        if (n <= WAYS) {
+            /* A single set: the last n pages stay */
+            g_assert_cmpint(count_cached(cache, 64), ==, n);
+            for (j = 64 - n; j < 64; j++) {
+                g_assert(page_matches(cache, j));
+            }
+        }
+    }
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init", test_init);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/lru_eviction", test_lru_eviction);
+    g_test_add_func("/page_cache/same_set_eviction", test_same_set_eviction);
+    g_test_add_func("/page_cache/resize", test_resize);
+    return g_test_run();
+}
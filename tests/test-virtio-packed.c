@@ -0,0 +1,108 @@
+/*
+ * Packed virtqueue notification suppression tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/virtio/virtio-packed.h"
+
+#define WRAP_BIT (1 << VRING_PACKED_EVENT_F_WRAP_CTR)
+
+typedef struct {
+    uint16_t num;
+    bool wrap;          /* used wrap counter after the move */
+    uint16_t off_wrap;
+    uint16_t new;
+    uint16_t old;
+    bool notify;
+} test_data;
+
+static const test_data test_table[] = {
+    /* No wrap: the event is passed iff old <= off < new */
+    { 256, true, WRAP_BIT | 15, 20, 10, true },
+    { 256, true, WRAP_BIT | 10, 20, 10, true },
+    { 256, true, WRAP_BIT | 19, 20, 10, true },
+    { 256, true, WRAP_BIT | 20, 20, 10, false },
+    { 256, true, WRAP_BIT | 9, 20, 10, false },
+    /* An event in the next lap is not reached yet */
+    { 256, true, 15, 20, 10, false },
+    /* Wrapped from 250 to 4: event early in the new lap */
+    { 256, false, 2, 4, 250, true },
+    { 256, false, 0, 4, 250, true },
+    { 256, false, 3, 4, 250, true },
+    { 256, false, 4, 4, 250, false },
+    { 256, false, 100, 4, 250, false },
+    /* Wrapped from 250 to 4: event late in the old lap */
+    { 256, false, WRAP_BIT | 250, 4, 250, true },
+    { 256, false, WRAP_BIT | 255, 4, 250, true },
+    { 256, false, WRAP_BIT | 200, 4, 250, false },
+    /* Same with the other wrap counter value */
+    { 256, true, WRAP_BIT | 2, 4, 250, true },
+    { 256, true, 252, 4, 250, true },
+    { 256, true, 200, 4, 250, false },
+    /* Largest ring */
+    { 1024, false, 1, 3, 1000, true },
+    { 1024, false, WRAP_BIT | 1023, 3, 1000, true },
+    { 1024, false, WRAP_BIT | 999, 3, 1000, false },
+};
+
+static void test_table_cases(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_table); i++) {
+        const test_data *t = &test_table[i];
+
+        g_assert_cmpint(vring_packed_need_event(t->num, t->wrap, t->off_wrap,
+                                                t->new, t->old),
+                        ==, t->notify);
+    }
+}
+
+/*
+ * Run the used index over many laps in random steps and compare against
+ * the same check done on free-running indices.
+ */
+static void test_random_laps(void)
+{
+    static const uint16_t nums[] = { 2, 16, 256, 1024 };
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(nums); i++) {
+        uint16_t num = nums[i];
+        uint32_t used = 0;
+
+        for (j = 0; j < 100000; j++) {
+            uint32_t old = used;
+            uint32_t lap_start = old - old % num;
+            uint32_t event;
+            uint16_t off_wrap;
+            bool wrap;
+
+            used += g_test_rand_int_range(1, num);
+            /* The event is in the lap of old or in the next one */
+            event = lap_start + g_test_rand_int_range(0, 2 * num);
+            off_wrap = event % num;
+            /* Wrap counters start at 1 */
+            if (!((event / num) & 1)) {
+                off_wrap |= WRAP_BIT;
+            }
+            wrap = !((used / num) & 1);
+
+            g_assert_cmpint(vring_packed_need_event(num, wrap, off_wrap,
+                                                    used % num, old % num),
+                            ==, old <= event && event < used);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/virtio/packed/need_event/table", test_table_cases);
+    g_test_add_func("/virtio/packed/need_event/random_laps",
+                    test_random_laps);
+    return g_test_run();
+}
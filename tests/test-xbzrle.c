@@ -174,6 +174,69 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_CASES 1000
+
+static void accel_fill_case(uint8_t *old_buf, uint8_t *new_buf)
+{
+    int i, j, runs, start, len, max_len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    /* Mix short and long runs so that they straddle vector boundaries */
+    max_len = g_test_rand_bit() ? 40 : 2000;
+    runs = g_test_rand_int_range(0, 64);
+    for (i = 0; i < runs; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            if (g_test_rand_int_range(0, 8)) {
+                new_buf[j] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE * ACCEL_CASES);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE * ACCEL_CASES);
+    uint8_t *ref = g_malloc(PAGE_SIZE * ACCEL_CASES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_CASES], dlen[ACCEL_CASES];
+    int i, rc;
+
+    for (i = 0; i < ACCEL_CASES; i++) {
+        accel_fill_case(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE);
+        /* Small destinations exercise the overflow paths as well */
+        dlen[i] = g_test_rand_int_range(16, PAGE_SIZE + 1);
+        ref_len[i] = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                          new_buf + i * PAGE_SIZE,
+                                          PAGE_SIZE, ref + i * PAGE_SIZE,
+                                          dlen[i]);
+    }
+
+    /* Every other accelerator must produce exactly the same stream */
+    while (xbzrle_encode_next_accel()) {
+        for (i = 0; i < ACCEL_CASES; i++) {
+            rc = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                      new_buf + i * PAGE_SIZE,
+                                      PAGE_SIZE, compressed, dlen[i]);
+            g_assert_cmpint(rc, ==, ref_len[i]);
+            if (rc > 0) {
+                g_assert(memcmp(compressed, ref + i * PAGE_SIZE, rc) == 0);
+            }
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +249,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Must come last, it leaves the slowest encoder selected */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -52,17 +52,17 @@ static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
     return dev;
 }
 
-static QOSState *pci_test_start(int socket)
+static QOSState *pci_test_start(int socket, const char *opts)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
     const char *cmd = "-netdev socket,fd=%d,id=hs0 -device "
-                      "virtio-net-pci,netdev=hs0";
+                      "virtio-net-pci,netdev=hs0%s";
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, socket);
+        qs = qtest_pc_boot(cmd, socket, opts);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, socket);
+        qs = qtest_spapr_boot(cmd, socket, opts);
     } else {
         g_printerr("virtio-net tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -193,6 +193,132 @@ static void rx_stop_cont_test(QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+#define RSC_MSS         1000
+#define RSC_SEGS        4
+#define RSC_LAST_LEN    500
+#define RSC_DATA_LEN    ((RSC_SEGS - 1) * RSC_MSS + RSC_LAST_LEN)
+#define RSC_HDR_LEN     (14 + 20 + 20)
+
+static uint16_t rsc_csum(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += i & 1 ? buf[i] : buf[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static uint8_t rsc_payload(int i)
+{
+    return i * 7 + 3;
+}
+
+/* Ethernet, IPv4 and TCP headers plus data for one segment of a flow */
+static size_t rsc_segment(uint8_t *frame, int seg)
+{
+    uint8_t *ip = frame + 14, *tcp = ip + 20;
+    int off = seg * RSC_MSS;
+    int len = seg == RSC_SEGS - 1 ? RSC_LAST_LEN : RSC_MSS;
+    uint32_t sum;
+    int i;
+
+    memset(frame, 0, RSC_HDR_LEN);
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, "\x52\x54\x00\x12\x34\x57", 6);
+    stw_be_p(frame + 12, 0x0800);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + len);
+    stw_be_p(ip + 4, seg);
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, "\x0a\x00\x02\x02\x0a\x00\x02\x0f", 8);
+    stw_be_p(ip + 10, rsc_csum(0, ip, 20));
+
+    stw_be_p(tcp, 80);
+    stw_be_p(tcp + 2, 12345);
+    stl_be_p(tcp + 4, 0x10000000 + off);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 5 << 4;
+    tcp[13] = seg == RSC_SEGS - 1 ? 0x18 : 0x10;   /* PSH on the last one */
+    stw_be_p(tcp + 14, 0xffff);
+    for (i = 0; i < len; i++) {
+        tcp[20 + i] = rsc_payload(off + i);
+    }
+
+    /* Pseudo header: addresses, protocol and TCP length */
+    sum = lduw_be_p(ip + 12) + lduw_be_p(ip + 14) +
+          lduw_be_p(ip + 16) + lduw_be_p(ip + 18) + 6 + 20 + len;
+    stw_be_p(tcp + 16, rsc_csum(sum, tcp, 20 + len));
+
+    return RSC_HDR_LEN + len;
+}
+
+/*
+ * The socket backend supplies no vnet header.  With rsc=on the device
+ * still offers TSO to the guest and delivers the TCP segments of a flow
+ * as a single GSO packet.
+ */
+static void rsc_test(QVirtioDevice *dev,
+                     QGuestAllocator *alloc, QVirtQueue *vq,
+                     int socket)
+{
+    uint8_t frames[RSC_SEGS][RSC_HDR_LEN + RSC_MSS];
+    uint32_t lens[RSC_SEGS];
+    struct iovec iov[RSC_SEGS * 2];
+    uint8_t *buffer;
+    uint64_t req_addr;
+    uint32_t free_head, len;
+    size_t total = 0;
+    int i, ret;
+
+    g_assert(dev->bus->get_guest_features(dev) &
+             (1u << VIRTIO_NET_F_GUEST_TSO4));
+
+    req_addr = guest_alloc(alloc, 8192);
+    free_head = qvirtqueue_add(vq, req_addr, 8192, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    /* One write, so that QEMU receives all segments back to back */
+    for (i = 0; i < RSC_SEGS; i++) {
+        size_t size = rsc_segment(frames[i], i);
+
+        lens[i] = htonl(size);
+        iov[2 * i].iov_base = &lens[i];
+        iov[2 * i].iov_len = sizeof(lens[i]);
+        iov[2 * i + 1].iov_base = frames[i];
+        iov[2 * i + 1].iov_len = size;
+        total += sizeof(lens[i]) + size;
+    }
+    ret = iov_send(socket, iov, RSC_SEGS * 2, 0, total);
+    g_assert_cmpint(ret, ==, total);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, &len, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + RSC_HDR_LEN + RSC_DATA_LEN);
+
+    g_assert_cmpint(readb(req_addr), ==, VIRTIO_NET_HDR_F_DATA_VALID);
+    g_assert_cmpint(readb(req_addr + 1), ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(readw(req_addr + 2), ==, RSC_HDR_LEN);
+    g_assert_cmpint(readw(req_addr + 4), ==, RSC_MSS);
+
+    buffer = g_malloc(RSC_HDR_LEN + RSC_DATA_LEN);
+    memread(req_addr + VNET_HDR_SIZE, buffer, RSC_HDR_LEN + RSC_DATA_LEN);
+    g_assert_cmpint(lduw_be_p(buffer + 14 + 2), ==, 20 + 20 + RSC_DATA_LEN);
+    g_assert_cmpint(rsc_csum(0, buffer + 14, 20), ==, 0);
+    g_assert_cmphex(ldl_be_p(buffer + 14 + 20 + 4), ==, 0x10000000);
+    g_assert_cmphex(buffer[14 + 20 + 13], ==, 0x18);
+    for (i = 0; i < RSC_DATA_LEN; i++) {
+        g_assert_cmphex(buffer[RSC_HDR_LEN + i], ==, rsc_payload(i));
+    }
+    g_free(buffer);
+
+    guest_free(alloc, req_addr);
+}
+
 static void send_recv_test(QVirtioDevice *dev,
                            QGuestAllocator *alloc, QVirtQueue *rvq,
                            QVirtQueue *tvq, int socket)
@@ -208,7 +334,14 @@ static void stop_cont_test(QVirtioDevice *dev,
     rx_stop_cont_test(dev, alloc, rvq, socket);
 }
 
-static void pci_basic(gconstpointer data)
+static void rsc_recv_test(QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *rvq,
+                          QVirtQueue *tvq, int socket)
+{
+    rsc_test(dev, alloc, rvq, socket);
+}
+
+static void pci_run(gconstpointer data, const char *opts)
 {
     QVirtioPCIDevice *dev;
     QOSState *qs;
@@ -223,7 +356,7 @@ static void pci_basic(gconstpointer data)
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
     g_assert_cmpint(ret, !=, -1);
 
-    qs = pci_test_start(sv[1]);
+    qs = pci_test_start(sv[1], opts);
     dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
 
     rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
@@ -241,6 +374,16 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+static void pci_basic(gconstpointer data)
+{
+    pci_run(data, "");
+}
+
+static void pci_rsc(gconstpointer data)
+{
+    pci_run(data, ",rsc=on");
+}
 #endif
 
 static void hotplug(void)
@@ -265,6 +408,7 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/rsc", rsc_recv_test, pci_rsc);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
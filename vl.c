@@ -335,6 +335,11 @@ static QemuOptsList qemu_accel_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Enable/disable multi-threaded TCG",
         },
+        {
+            .name = "superblocks",
+            .type = QEMU_OPT_BOOL,
+            .help = "Retranslate hot TCG code paths as superblocks",
+        },
         { /* end of list */ }
     },
 };